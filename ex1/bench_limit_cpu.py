@@ -0,0 +1,71 @@
+#!/usr/bin/python
+
+# Commands/s of the cgroup executor, one shell per command versus native.
+# Runs against a scratch directory instead of the real cgroup mount,
+# so it measures the executor itself and needs no root.
+#
+# Usage: bench_limit_cpu.py [apps] [rounds]
+
+import sys
+import os
+import time
+import shutil
+import tempfile
+
+import mod_limit_cpu
+
+def workload(apps, rounds):
+	"""Create apps, add a task to each, then reset every limit each round."""
+	batches = []
+	batches.append([mod_limit_cpu.parse("create:bench:cpu:app%d" % i) for i in range(apps)])
+	batches.append([mod_limit_cpu.parse("add:bench:cpu:app%d:%d" % (i, 1000 + i)) for i in range(apps)])
+	for r in range(rounds):
+		batches.append([mod_limit_cpu.parse("set_limit:bench:cpu:app%d:cpu.shares:%d" % (i, 100 + (r + i) % 900))
+			for i in range(apps)])
+	batches.append([mod_limit_cpu.parse("remove:bench:cpu:app%d" % i) for i in range(apps)])
+	return batches
+
+def bench(executor_class, batches):
+	root = tempfile.mkdtemp(prefix='cgbench') + '/'
+	executor = executor_class(root)
+	ncmds = sum(len(b) for b in batches)
+	elapsed = limits = 0.0
+	for batch in batches:
+		start = time.time()
+		executor.run(batch)
+		t = time.time() - start
+		elapsed += t
+		if batch[0][0] == 'set_limit':
+			limits += t
+	shutil.rmtree(root, ignore_errors=True)
+	return ncmds / elapsed, limits / (len(batches) - 3)
+
+if __name__ == '__main__':
+	apps = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+	rounds = int(sys.argv[2]) if len(sys.argv) > 2 else 20
+	batches = workload(apps, rounds)
+
+	# The executor only writes files that are there, as cgroupfs makes
+	# them with the group; rmdir of a plain directory fails while it
+	# still holds files, so drop them before the remove round
+	class Native(mod_limit_cpu.NativeExecutor):
+		def create(self, inp):
+			mod_limit_cpu.NativeExecutor.create(self, inp)
+			for name in ('cgroup.procs', 'tasks', 'cpu.shares'):
+				open(self.group(inp) + '/' + name, 'a').close()
+		def remove(self, inp):
+			path = self.group(inp)
+			self.close(path)
+			for f in os.listdir(path):
+				os.unlink(path + '/' + f)
+			os.rmdir(path)
+	class Shell(mod_limit_cpu.ShellExecutor):
+		def run(self, batch):
+			if batch[0][0] == 'remove':
+				os.system("rm -f " + self.root + "bench/*/*")
+			mod_limit_cpu.ShellExecutor.run(self, batch)
+
+	for name, cls in [('shell', Shell), ('native', Native)]:
+		rate, per_round = bench(cls, batches)
+		sys.stdout.write("%-7s %10.0f commands/s  %8.3f ms per round of %d apps\n" %
+			(name, rate, per_round * 1000, apps))
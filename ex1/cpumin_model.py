@@ -0,0 +1,34 @@
+# The workload traces and the model of CFS that eval_cpumin.py and
+# sim_cpumin.py score policies with.
+#
+# A trace is a list of rounds, separated by empty lines, of
+# "app:request:demand[:field...]" lines; lines starting with '#' are
+# comments. Only the request and the fields after the demand are shown
+# to a policy; demand is what the app could actually use.
+#
+# CFS is modelled as work conserving: the machine, worth the budget, is
+# divided in proportion to cpu.shares, and whatever an app cannot use
+# goes to the others, again by shares. That is the policy's own
+# water-filling, with the shares as weights and the demands as caps.
+
+import mod_policy_cpumin as policy
+
+def load(path):
+	rounds = [[]]
+	for line in open(path):
+		line = line.strip()
+		if line.startswith('#'):
+			continue
+		if not line:
+			if rounds[-1]:
+				rounds.append([])
+			continue
+		rounds[-1].append(line.split(':'))
+	return [r for r in rounds if r]
+
+def cfs(shares, demands, budget=policy.virtual):
+	"""What every app gets of the budget, given its shares and demand."""
+	apps = list(demands)
+	got = policy.pour(budget, [0.0] * len(apps),
+		[demands[app] for app in apps], [shares[app] for app in apps])
+	return dict(zip(apps, got))
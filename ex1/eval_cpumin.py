@@ -0,0 +1,67 @@
+#!/usr/bin/python
+
+# Scores the cpumin allocators on the workload scenarios in scenarios/.
+#
+# A scenario is a list of rounds, separated by empty lines, of
+# "app:request:demand[:weight[:cap]]" lines. Only request, weight and cap
+# are shown to the policy; demand is what the app could actually use.
+#
+# CFS is modelled as work conserving, by cpumin_model.py as sim_cpumin.py
+# does; the shares only count relative to each other. A round is scored by
+# the mean fraction of each app's demand it got, plain and weighted by the
+# apps' weights; the latter is what the weights of weighted.txt ask an
+# allocator to favour.
+# Rounds whose shares add up to more than the budget are counted too.
+#
+# By plain coverage the waterfill allocator is level with the equal split,
+# the default: slightly ahead on most scenarios and behind on weighted.txt,
+# where the equal split hands the spare shares to the small apps, whose
+# coverage grows fastest per share, and waterfill follows the weights.
+# What it does offer is honouring the weights and never overshooting the
+# budget.
+#
+# Usage: eval_cpumin.py [scenario...]
+
+import sys
+import os
+import glob
+
+import mod_policy_cpumin as policy
+from cpumin_model import load, cfs
+
+def round_score(apps, limits):
+	"""The plain and weighted mean coverage of a round, and if it overshot."""
+	shares = dict(limits)
+	demands = dict((app[0], float(app[2])) for app in apps)
+	got = cfs(shares, demands)
+	covered = dict((app, min(got[app], d) / d if d else 1.0) for app, d in demands.items())
+	weights = dict((app[0], float(app[3]) if len(app) > 3 and app[3] else 1.0) for app in apps)
+	weighted = sum(covered[app] * weights[app] for app in covered) / sum(weights.values())
+	return sum(covered.values()) / len(covered), weighted, sum(shares.values()) > policy.virtual
+
+def evaluate(rounds, allocator):
+	score = 0.0
+	weighted = 0.0
+	overshoots = 0
+	for apps in rounds:
+		# Turn the scenario line into what the monitor would send
+		lines = ['policy:%s:cpu:%s:%s' % (a[0], a[1], ':'.join(a[3:])) for a in apps]
+		total_list = policy.read_apps(lines)
+		_, limits = policy.allocate(total_list, allocator)
+		s, w, over = round_score(apps, limits)
+		score += s
+		weighted += w
+		overshoots += over
+	return score / len(rounds), weighted / len(rounds), overshoots
+
+if __name__ == '__main__':
+	paths = sys.argv[1:] or sorted(glob.glob(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'scenarios', '*.txt')))
+	names = sorted(policy.ALLOCATORS)
+	sys.stdout.write('%-14s' % 'scenario' + ''.join('%27s' % (n + ' plain/weighted') for n in names) + '\n')
+	for path in paths:
+		rounds = load(path)
+		sys.stdout.write('%-14s' % os.path.basename(path)[:-4])
+		for name in names:
+			score, weighted, overshoots = evaluate(rounds, name)
+			sys.stdout.write('%12.3f %6.3f (%2d over)' % (score, weighted, overshoots))
+		sys.stdout.write('\n')
@@ -2,24 +2,526 @@
 
 import sys
 import os
+import errno
+import shlex
+import select
+import argparse
 import subprocess
+import multiprocessing
 
-inp = []
 mainpath = "/sys/fs/cgroup/cpu/"
+mainpath_v2 = "/sys/fs/cgroup/"
+mainpath_cpuset = "/sys/fs/cgroup/cpuset/"
 
-for line in sys.stdin:
-	inp = line[:-1].split(":")
-	if line.startswith('create'):
-		#path = mainpath + inp[1]
-		#os.system("mkdir -p " + path)
-		path = mainpath + inp[1] + '/' + inp[3]
-		os.system("mkdir -p " + path)
-	elif line.startswith('remove'):
-		path = mainpath + inp[1] + '/' + inp[3]
-		os.system("rmdir " + path)
-	elif line.startswith('add'):
-		path = mainpath + inp[1] + '/' + inp[3] + '/tasks'
-		os.system("echo " + inp[4] + ' >> ' + path)
-	elif line.startswith('set_limit'):
-		path = mainpath + inp[1] + '/' + inp[3] + '/cpu.shares'
-		os.system("echo " + inp[5] + ' > ' + path)
+# cgroup v1 mounts of the other controllers a command can name
+hierarchies_v1 = {
+	'memory': "/sys/fs/cgroup/memory/",
+	'io': "/sys/fs/cgroup/blkio/",
+	'blkio': "/sys/fs/cgroup/blkio/",
+}
+
+# Commands of a round are applied in this order, so that groups exist
+# and have their CPUs and memory nodes before tasks are moved in, and
+# tasks are moved or started before groups go away.
+ORDER = ['create', 'set_limit', 'set_cpus', 'set_mems', 'add', 'spawn', 'remove']
+
+def parse(line):
+	"""
+	Split a command. The app field may be a "/"-separated path, for
+	groups nested to any depth under the policy's group.
+	"""
+	inp = line.rstrip('\r\n').split(":")
+	if inp[0] not in ORDER:
+		return None
+	if len(inp) < 4 or [p for p in inp[3].split('/') if p in ('', '.', '..')]:
+		sys.stderr.write("%s: bad group path\n" % line.rstrip('\r\n'))
+		return None
+	return inp
+
+def ancestors(root, inp):
+	"""The directories above the app's group, from the policy's group down."""
+	parts = [inp[1]] + inp[3].split('/')[:-1]
+	return [root + '/'.join(parts[:i + 1]) + '/' for i in range(len(parts))]
+
+def sched_idle(tids, on):
+	"""SCHED_IDLE, or back to SCHED_OTHER, for every thread still there."""
+	if not hasattr(os, 'SCHED_IDLE'):
+		raise OSError(errno.ENOSYS, 'SCHED_IDLE needs Python 3.3')
+	policy = os.SCHED_IDLE if on else os.SCHED_OTHER
+	for tid in tids:
+		try:
+			os.sched_setscheduler(int(tid), policy, os.sched_param(0))
+		except OSError as e:
+			if e.errno != errno.ESRCH:
+				raise
+
+def pids(inp):
+	"""The ids of an add command, separated by commas or spaces."""
+	return inp[4].replace(',', ' ').split()
+
+class ShellExecutor:
+	"""The original executor, one shell per command."""
+	def __init__(self, root):
+		self.root = root
+
+	def run(self, batch):
+		for inp in batch:
+			if inp[0] == 'create':
+				path = self.root + inp[1] + '/' + inp[3]
+				os.system("mkdir -p " + path)
+			elif inp[0] == 'remove':
+				path = self.root + inp[1] + '/' + inp[3]
+				os.system("rmdir " + path)
+			elif inp[0] == 'add':
+				path = self.root + inp[1] + '/' + inp[3] + '/tasks'
+				os.system("echo " + inp[4] + ' >> ' + path)
+			elif inp[0] == 'set_limit':
+				path = self.root + inp[1] + '/' + inp[3] + '/' + inp[4]
+				os.system("echo '" + ':'.join(inp[5:]) + "' > " + path)
+
+class NativeExecutor:
+	"""
+	Performs mkdir/rmdir and cgroup file writes directly, keeping
+	the cpu.shares and tasks files of every group open across rounds.
+	The third field of a command names the controller, and on cgroup v1
+	picks the hierarchy: root for cpu, hierarchies for the others.
+	"""
+	def __init__(self, root, quota=None, cpuset_root=mainpath_cpuset, hierarchies=None):
+		self.root = root
+		self.fds = {}
+		self.quota = quota
+		self.cpuset_root = cpuset_root
+		self.cpusets = set()
+		self.hierarchies = dict(hierarchies_v1)
+		self.hierarchies.update(hierarchies or {})
+		self.hierarchies['cpu'] = root
+		self.children = []
+		# Groups whose tasks are SCHED_IDLE, for kernels without cpu.idle
+		self.idle = set()
+		self.threads = 'tasks'
+
+	def group(self, inp):
+		return self.hierarchies.get(inp[2], self.root) + inp[1] + '/' + inp[3]
+
+	def read(self, path):
+		try:
+			return open(path).read().strip()
+		except (IOError, OSError):
+			return ''
+
+	def write(self, path, value):
+		fd = self.fds.get(path)
+		if fd is None:
+			fd = os.open(path, os.O_WRONLY | os.O_APPEND)
+			self.fds[path] = fd
+		# cgroup files take exactly one value per write()
+		os.write(fd, (value + '\n').encode())
+
+	def close(self, path):
+		for p in [p for p in self.fds if p == path or p.startswith(path + '/')]:
+			os.close(self.fds.pop(p))
+
+	def create(self, inp):
+		try:
+			os.makedirs(self.group(inp))
+		except OSError as e:
+			if e.errno != errno.EEXIST:
+				raise
+
+	def remove(self, inp):
+		path = self.group(inp)
+		self.close(path)
+		os.rmdir(path)
+		self.idle.discard(path)
+		path = self.cpuset_root + inp[1] + '/' + inp[3]
+		if path in self.cpusets:
+			self.close(path)
+			self.cpusets.discard(path)
+			os.rmdir(path)
+
+	def migrate(self, paths, ids):
+		"""One write per id; ids that are gone do not stop the others."""
+		gone = 0
+		for path in paths:
+			for pid in ids:
+				try:
+					self.write(path, pid)
+				except OSError as e:
+					if e.errno != errno.ESRCH:
+						raise
+					gone += 1
+		if gone:
+			raise OSError(errno.ESRCH, os.strerror(errno.ESRCH))
+
+	def add(self, inp):
+		"""
+		add:<policy>:<controller>:<app>:<pid>[,<pid>...][:threads]
+		Moves whole processes, with all of their threads, through
+		cgroup.procs. With :threads the ids are single threads, moved
+		through tasks.
+		"""
+		name = '/tasks' if len(inp) > 5 and inp[5] == 'threads' else '/cgroup.procs'
+		paths = [self.group(inp) + name]
+		path = self.cpuset_root + inp[1] + '/' + inp[3]
+		if path in self.cpusets:
+			paths.append(path + name)
+		try:
+			self.migrate(paths, pids(inp))
+		finally:
+			# Even if some ids were gone, the rest did move
+			self.follow_idle(inp)
+
+	def follow_idle(self, inp):
+		"""Tasks moved into a SCHED_IDLE group become SCHED_IDLE too."""
+		if self.group(inp) in self.idle:
+			sched_idle(self.read(self.group(inp) + '/' + self.threads).split(), True)
+
+	def spawn_groups(self, inp):
+		"""The cgroup.procs of the app's group in every hierarchy it exists in."""
+		paths = [self.group(inp)]
+		for root in [self.cpuset_root] + list(self.hierarchies.values()):
+			path = root + inp[1] + '/' + inp[3]
+			if path not in paths and os.path.isdir(path):
+				paths.append(path)
+		return [path + '/cgroup.procs' for path in paths]
+
+	def spawn(self, inp):
+		"""
+		spawn:<policy>:<controller>:<app>:<command line>
+		Starts the command inside the app's groups. The child moves itself
+		in before exec, so every thread it ever starts is born there and
+		nothing has to be migrated later. It never runs outside them.
+		"""
+		paths = self.spawn_groups(inp)
+		idle = self.group(inp) in self.idle
+		def enter():
+			try:
+				for path in paths:
+					fd = os.open(path, os.O_WRONLY | os.O_APPEND)
+					os.write(fd, str(os.getpid()).encode())
+					os.close(fd)
+				if idle:
+					sched_idle([0], True)
+			except OSError as e:
+				os.write(2, ("%s: %s\n" % (path, e.strerror)).encode())
+				os._exit(126)
+		devnull = open(os.devnull)
+		self.children.append(subprocess.Popen(shlex.split(':'.join(inp[4:])),
+			stdin=devnull, preexec_fn=enter, close_fds=True))
+		devnull.close()
+
+	def cpuset_group(self, inp):
+		"""
+		On cgroup v1 cpuset is a hierarchy of its own. The group is made
+		there the first time it is placed, and it and its policy parent
+		start with all of the root's CPUs and nodes, which a group needs
+		before it can take any task. So do the groups between them, in a
+		deeper hierarchy. The tasks already in the app's cpu group are
+		moved in, thread by thread as they are there, and from then on
+		tasks added to the group also go in there.
+		"""
+		path = self.cpuset_root + inp[1] + '/' + inp[3]
+		if path in self.cpusets:
+			return path
+		for d in ancestors(self.cpuset_root, inp) + [path]:
+			if not os.path.isdir(d):
+				os.makedirs(d)
+			for name in ('cpuset.cpus', 'cpuset.mems'):
+				if not self.read(d + '/' + name):
+					self.write(d + '/' + name, self.read(self.cpuset_root + name))
+		self.cpusets.add(path)
+		tids = self.read(self.root + inp[1] + '/' + inp[3] + '/tasks').split()
+		try:
+			self.migrate([path + '/tasks'], tids)
+		except OSError as e:
+			if e.errno != errno.ESRCH:
+				raise
+		return path
+
+	def set_cpus(self, inp):
+		"""
+		set_cpus:<policy>:cpuset:<app>:cpuset.cpus:<cpulist>
+		The file is named like in set_limit, the policy writes it the same.
+		"""
+		self.write(self.cpuset_group(inp) + '/cpuset.cpus', inp[5])
+
+	def set_mems(self, inp):
+		"""set_mems:<policy>:cpuset:<app>:cpuset.mems:<nodelist>"""
+		self.write(self.cpuset_group(inp) + '/cpuset.mems', inp[5])
+
+	def translate(self, name, value):
+		"""
+		The cgroup v1 files and values that implement a limit. memory.high
+		has no real v1 counterpart, the soft limit is the closest.
+		"""
+		if name in ('memory.max', 'memory.high'):
+			v1 = {'memory.max': 'memory.limit_in_bytes', 'memory.high': 'memory.soft_limit_in_bytes'}
+			return [(v1[name], '-1' if value == 'max' else value)]
+		if name == 'io.weight':
+			fields = value.split()
+			weight = str(io_weight_to_v1(int(fields[-1])))
+			if len(fields) > 1 and fields[0] != 'default':
+				return [('blkio.weight_device', fields[0] + ' ' + weight)]
+			return [('blkio.weight', weight)]
+		if name == 'io.max':
+			return io_max_to_v1(value)
+		if name == 'cpu.weight':
+			return [('cpu.shares', str(weight_to_shares(int(value))))]
+		if name == 'cpu.max':
+			quota, period = parse_max(value)
+			return [('cpu.cfs_period_us', str(period)),
+				('cpu.cfs_quota_us', str(quota) if quota is not None else '-1')]
+		if name == 'cpu.max.burst':
+			return [('cpu.cfs_burst_us', value)]
+		return [(name, value)]
+
+	def set_limit(self, inp):
+		"""set_limit:<policy>:<controller>:<app>:<file>:<value>, the value may hold colons"""
+		limit = ':'.join(inp[5:])
+		if inp[4] == 'cpu.idle' and self.no_cpu_idle(inp):
+			on = limit.strip() == '1'
+			sched_idle(self.read(self.group(inp) + '/' + self.threads).split(), on)
+			(self.idle.add if on else self.idle.discard)(self.group(inp))
+			return
+		for name, value in self.translate(inp[4], limit):
+			self.write(self.group(inp) + '/' + name, value)
+		if self.quota and inp[4] in ('cpu.shares', 'cpu.weight'):
+			shares = int(inp[5])
+			if inp[4] == 'cpu.weight':
+				shares = weight_to_shares(shares)
+			self.hard_quota(inp, shares)
+
+	def no_cpu_idle(self, inp):
+		"""
+		cpu.idle came with 5.15; on a real cgroup without it, the group's
+		tasks themselves are made SCHED_IDLE instead.
+		"""
+		path = self.group(inp)
+		return os.path.exists(path + '/cgroup.procs') and not os.path.exists(path + '/cpu.idle')
+
+	def hard_quota(self, inp, shares):
+		"""
+		Cap the group at its slice of the whole machine, shares / budget
+		of all CPUs, on top of its proportional weight.
+		"""
+		budget, period, burst = self.quota
+		quota = max(1000, int(float(shares) / budget * multiprocessing.cpu_count() * period))
+		for name, value in self.translate('cpu.max', '%d %d' % (quota, period)):
+			self.write(self.group(inp) + '/' + name, value)
+		if burst:
+			for name, value in self.translate('cpu.max.burst', str(min(burst, quota))):
+				self.write(self.group(inp) + '/' + name, value)
+
+	def run(self, batch):
+		self.children = [c for c in self.children if c.poll() is None]
+		# Only the last value of a limit of a group in a round matters
+		limits = {}
+		for inp in batch:
+			if inp[0] == 'set_limit':
+				limits[(self.group(inp), inp[4])] = inp
+		for cmd in ORDER:
+			for inp in batch:
+				if inp[0] != cmd:
+					continue
+				if cmd == 'set_limit' and limits[(self.group(inp), inp[4])] is not inp:
+					continue
+				try:
+					getattr(self, cmd)(inp)
+				except (OSError, IOError) as e:
+					sys.stderr.write("%s: %s\n" % (':'.join(inp), e.strerror))
+
+class NativeV2Executor(NativeExecutor):
+	"""
+	The same on the cgroup v2 unified hierarchy: cpu.shares limits become
+	cpu.weight, tasks are moved through cgroup.procs, and the command's
+	controller is enabled on the way down to every group created. All
+	controllers share the one group of an app.
+	"""
+	def __init__(self, root, quota=None, cpuset_root=None, hierarchies=None):
+		NativeExecutor.__init__(self, root, quota)
+		self.enabled = set()
+		self.threads = 'cgroup.threads'
+
+	def group(self, inp):
+		return self.root + inp[1] + '/' + inp[3]
+
+	def create(self, inp):
+		NativeExecutor.create(self, inp)
+		controller = {'memory': 'memory', 'io': 'io', 'blkio': 'io'}.get(inp[2], 'cpu')
+		self.enable(self.root, controller)
+		for path in ancestors(self.root, inp):
+			self.enable(path, controller)
+
+	def enable(self, path, controller='cpu'):
+		if (path, controller) in self.enabled:
+			return
+		self.write(path + 'cgroup.subtree_control', '+' + controller)
+		self.enabled.add((path, controller))
+
+	def remove(self, inp):
+		path = self.group(inp)
+		self.close(path)
+		os.rmdir(path)
+		self.idle.discard(path)
+		self.enabled = set(e for e in self.enabled if not e[0].startswith(path + '/'))
+
+	def add(self, inp):
+		"""v2 only moves whole processes, unless the group is threaded."""
+		name = '/cgroup.threads' if len(inp) > 5 and inp[5] == 'threads' else '/cgroup.procs'
+		try:
+			self.migrate([self.group(inp) + name], pids(inp))
+		finally:
+			self.follow_idle(inp)
+
+	def spawn_groups(self, inp):
+		return [self.group(inp) + '/cgroup.procs']
+
+	def set_cpus(self, inp):
+		self.enable(self.root, 'cpuset')
+		for path in ancestors(self.root, inp):
+			self.enable(path, 'cpuset')
+		self.write(self.group(inp) + '/cpuset.cpus', inp[5])
+
+	def set_mems(self, inp):
+		self.enable(self.root, 'cpuset')
+		for path in ancestors(self.root, inp):
+			self.enable(path, 'cpuset')
+		self.write(self.group(inp) + '/cpuset.mems', inp[5])
+
+	def translate(self, name, value):
+		if name in ('memory.limit_in_bytes', 'memory.soft_limit_in_bytes'):
+			v2 = {'memory.limit_in_bytes': 'memory.max', 'memory.soft_limit_in_bytes': 'memory.high'}
+			return [(v2[name], 'max' if value == '-1' else value)]
+		if name == 'blkio.weight':
+			return [('io.weight', 'default %d' % io_weight_to_v2(int(value)))]
+		if name == 'cpu.shares':
+			return [('cpu.weight', str(shares_to_weight(int(value))))]
+		if name == 'cpu.max':
+			quota, period = parse_max(value)
+			return [('cpu.max', '%s %d' % (quota if quota is not None else 'max', period))]
+		return [(name, value)]
+
+def shares_to_weight(shares):
+	"""The usual v1 cpu.shares [2, 262144] to v2 cpu.weight [1, 10000] mapping."""
+	shares = min(max(shares, 2), 262144)
+	return 1 + ((shares - 2) * 9999) // 262142
+
+def weight_to_shares(weight):
+	weight = min(max(weight, 1), 10000)
+	return 2 + ((weight - 1) * 262142) // 9999
+
+def io_weight_to_v1(weight):
+	"""v2 io.weight [1, 10000] to v1 blkio.weight [10, 1000], 100 being the default of both."""
+	weight = min(max(weight, 1), 10000)
+	if weight <= 100:
+		return 10 + (weight - 1) * 90 // 99
+	return 100 + (weight - 100) * 900 // 9900
+
+def io_weight_to_v2(weight):
+	weight = min(max(weight, 10), 1000)
+	if weight <= 100:
+		return 1 + (weight - 10) * 99 // 90
+	return 100 + (weight - 100) * 9900 // 900
+
+def io_max_to_v1(value):
+	"""
+	Split an io.max "<major>:<minor> rbps=N wbps=N riops=N wiops=N" line
+	into the v1 throttle files, where 0 stands for max.
+	"""
+	fields = value.split()
+	files = {'rbps': 'blkio.throttle.read_bps_device', 'wbps': 'blkio.throttle.write_bps_device',
+		'riops': 'blkio.throttle.read_iops_device', 'wiops': 'blkio.throttle.write_iops_device'}
+	out = []
+	for field in fields[1:]:
+		key, limit = field.split('=')
+		out.append((files[key], '%s %s' % (fields[0], '0' if limit == 'max' else limit)))
+	return out
+
+def parse_max(value):
+	"""Split a "<quota|max> [period]" cpu.max value, period defaults to 100ms."""
+	fields = value.split()
+	quota = None if fields[0] == 'max' else int(fields[0])
+	period = int(fields[1]) if len(fields) > 1 else 100000
+	return quota, period
+
+def detect():
+	"""Pick the backend from the hierarchy mounted on /sys/fs/cgroup."""
+	if os.path.exists(mainpath_v2 + 'cgroup.controllers'):
+		return NativeV2Executor, mainpath_v2
+	return NativeExecutor, mainpath
+
+def rounds(fd):
+	"""
+	Yield the commands of each round as one batch. A round is everything
+	that arrives together on stdin, or ends with an empty line.
+	"""
+	pending = b''
+	batch = []
+	while True:
+		data = os.read(fd, 65536)
+		if not data:
+			break
+		pending += data
+		lines = pending.split(b'\n')
+		pending = lines.pop()
+		for line in lines:
+			line = line.decode()
+			if not line.strip():
+				if batch:
+					yield batch
+				batch = []
+				continue
+			inp = parse(line)
+			if inp:
+				batch.append(inp)
+		if batch and not select.select([fd], [], [], 0)[0]:
+			yield batch
+			batch = []
+	if pending.strip():
+		inp = parse(pending.decode())
+		if inp:
+			batch.append(inp)
+	if batch:
+		yield batch
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--shell', action='store_true',
+		help='one os.system() per command, cgroup v1 only, for comparison')
+	parser.add_argument('--cgroup', choices=['auto', 'v1', 'v2'], default='auto',
+		help='cgroup hierarchy to drive, detected from /sys/fs/cgroup by default')
+	parser.add_argument('--root', help='directory holding the policy groups')
+	parser.add_argument('--cpuset-root', default=mainpath_cpuset,
+		help='cgroup v1 cpuset hierarchy, for set_cpus and set_mems')
+	parser.add_argument('--hierarchy', action='append', default=[], metavar='CONTROLLER=PATH',
+		help='cgroup v1 mount of the memory or io controller, if not the usual one')
+	parser.add_argument('--hard-quota', type=float, metavar='BUDGET',
+		help='also cap every group at shares / BUDGET of all CPUs with cpu.max')
+	parser.add_argument('--period', type=int, default=100000,
+		help='cpu.max period in usecs for --hard-quota')
+	parser.add_argument('--burst', type=int, default=0,
+		help='cpu.max.burst in usecs for --hard-quota')
+	args = parser.parse_args()
+
+	if args.cgroup == 'v1':
+		backend, root = NativeExecutor, mainpath
+	elif args.cgroup == 'v2':
+		backend, root = NativeV2Executor, mainpath_v2
+	else:
+		backend, root = detect()
+	if args.root:
+		root = os.path.join(args.root, '')
+
+	quota = None
+	if args.hard_quota:
+		quota = (args.hard_quota, args.period, args.burst)
+
+	if args.shell:
+		executor = ShellExecutor(root)
+	else:
+		hierarchies = dict((h.split('=', 1)[0], os.path.join(h.split('=', 1)[1], ''))
+			for h in args.hierarchy)
+		executor = backend(root, quota, os.path.join(args.cpuset_root, ''), hierarchies)
+
+	for batch in rounds(sys.stdin.fileno()):
+		executor.run(batch)
@@ -2,33 +2,844 @@
 
 import sys
 import os
+import glob
+import json
+import math
+import time
+import select
+import tempfile
+import argparse
+import multiprocessing
 
-temp = []
-total_list = []
-total = 0.0
 virtual = 2000.0
-elastic = 0
-
-for line in sys.stdin:
-	temp = line.split(":")
-	temp[3] = int(temp[3])
-	total += temp[3]
-	if temp[3] <= 50:
-		elastic += 1
-	total_list.append(temp)
-
-if total > virtual:
-	os.system("echo score:-0.1")
-else:
-	os.system("echo score:0.1")
-
-for app in total_list:
-	if total <= virtual:
-		if elastic == 0:
-			os.system("echo set_limit:"+app[1]+":cpu.shares:"+str(app[3]))
+
+def read_apps(lines):
+	"""
+	Parse the monitor's "<kind>:<app>:<resource>:<request>[:<weight>[:<cap>]]"
+	lines, optionally followed by "<tag>=<value>" fields in any order.
+	Weight and cap are only used by the waterfill allocator, and may also
+	be given as weight= and cap= tags. Every entry comes out as
+	[kind, app, resource, request, weight, cap, tags], with '' for a
+	missing weight or cap.
+	"""
+	total_list = []
+	for line in lines:
+		temp = line.strip().split(":")
+		if len(temp) < 4:
+			continue
+		extra = ['', '']
+		tags = {}
+		pos = 0
+		for field in temp[4:]:
+			if '=' in field:
+				key, value = field.split('=', 1)
+				tags[key] = value
+				continue
+			if pos < len(extra):
+				extra[pos] = field
+			pos += 1
+		extra[0] = tags.get('weight', extra[0])
+		extra[1] = tags.get('cap', extra[1])
+		total_list.append(temp[:3] + [int(temp[3])] + extra + [tags])
+	return total_list
+
+def score_of(total_list):
+	total = sum(app[3] for app in total_list)
+	if total > virtual:
+		return "-0.1"
+	return "0.1"
+
+def allocate_equal(total_list):
+	"""
+	The original allocation: the spare shares go in equal parts to the
+	apps that asked for at most 50, everybody else gets the request.
+	"""
+	total = 0.0
+	elastic = 0
+	for temp in total_list:
+		total += temp[3]
+		if temp[3] <= 50:
+			elastic += 1
+
+	limits = []
+	for app in total_list:
+		limit = app[3]
+		if total <= virtual and elastic != 0 and app[3] <= 50:
+			limit = app[3] + int((virtual - total) / elastic)
+		limits.append((app[1], limit))
+	return limits
+
+def pour(budget, floors, caps, weights):
+	"""
+	Max-min fair division of a budget. Every app gets its floor, then what
+	is left is poured in proportion to the weights, apps dropping out as
+	they reach their cap. Returns the fractional amounts.
+	"""
+	n = len(floors)
+	alloc = [float(f) for f in floors]
+	left = float(budget - sum(floors))
+	active = set(i for i in range(n) if caps[i] > alloc[i] and weights[i] > 0)
+	while left > 1e-9 and active:
+		wsum = sum(weights[i] for i in active)
+		full = [i for i in active if left * weights[i] / wsum >= caps[i] - alloc[i]]
+		if not full:
+			for i in active:
+				alloc[i] += left * weights[i] / wsum
+			break
+		for i in full:
+			left -= caps[i] - alloc[i]
+			alloc[i] = caps[i]
+			active.discard(i)
+	return alloc
+
+def waterfill(budget, floors, caps, weights):
+	"""
+	pour() of an integer budget, in integers summing to exactly
+	min(budget, sum(caps)), rounded by largest remainder.
+	"""
+	n = len(floors)
+	alloc = pour(budget, floors, caps, weights)
+	out = [int(a) for a in alloc]
+	units = int(round(sum(alloc))) - sum(out)
+	order = sorted(range(n), key=lambda i: alloc[i] - out[i], reverse=True)
+	for i in order[:units]:
+		out[i] += 1
+	return out
+
+def app_weights(total_list, weight=1.0):
+	return [float(app[4]) if len(app) > 4 and app[4] else weight for app in total_list]
+
+def app_caps(total_list, cap=None):
+	if cap is None:
+		cap = int(virtual)
+	return [int(app[5]) if len(app) > 5 and app[5] else cap for app in total_list]
+
+def allocate_waterfill(total_list, weight=1.0, cap=None, budget=virtual):
+	"""
+	Every app is guaranteed its request and the spare shares of the budget
+	are water-filled by weight up to each app's cap. If the requests alone
+	exceed the budget, the budget itself is divided max-min fairly, with
+	the requests as caps, so the total never overshoots.
+	"""
+	requests = [app[3] for app in total_list]
+	weights = app_weights(total_list, weight)
+	caps = app_caps(total_list, cap if cap is not None else int(budget))
+
+	if sum(requests) <= budget:
+		shares = waterfill(int(budget), requests,
+			[max(c, r) for c, r in zip(caps, requests)], weights)
+	else:
+		shares = waterfill(int(budget), [0] * len(requests),
+			[min(c, r) for c, r in zip(caps, requests)], weights)
+	return [(app[1], s) for app, s in zip(total_list, shares)]
+
+ALLOCATORS = {
+	"equal": allocate_equal,
+	"waterfill": allocate_waterfill,
+}
+
+def allocate(total_list, allocator="equal", **kwargs):
+	"""Return the score and the cpu.shares of every app for this round."""
+	return score_of(total_list), ALLOCATORS[allocator](total_list, **kwargs)
+
+def tree(total_list):
+	"""
+	The hierarchy spelled by "/"-separated app names, as {path: entry}
+	and {parent path: [child paths]}, the top level under "". A line may
+	describe an inner node and give it a request, weight or cap of its
+	own; otherwise an inner node asks for what its children ask for.
+	"""
+	nodes = {}
+	children = {}
+	for app in total_list:
+		nodes[app[1]] = list(app)
+	for app in total_list:
+		parts = app[1].split("/")
+		for i in range(len(parts)):
+			path = "/".join(parts[:i + 1])
+			if path not in nodes:
+				nodes[path] = [app[0], path, app[2], None, "", "", {}]
+			siblings = children.setdefault("/".join(parts[:i]), [])
+			if path not in siblings:
+				siblings.append(path)
+	for path in sorted(nodes, key=lambda p: -p.count("/")):
+		if nodes[path][3] is None:
+			nodes[path][3] = sum(nodes[c][3] for c in children.get(path, []))
+	return nodes, children
+
+def allocate_tree(total_list, budget=virtual, weight=1.0, cap=None):
+	"""
+	Top-down division of the budget over the hierarchy: the top level
+	shares the budget as in allocate_waterfill(), then every node's
+	allocation is divided among its children the same way. Every level
+	still water-fills its spare shares against all siblings' requests,
+	so a change inside one subtree may move what its siblings, and
+	everything below them, get: every node whose limit moved has to be
+	emitted again, not just the subtree that changed. Returns the
+	allocation of every node, inner ones included, which is what their
+	cgroups need as the siblings' relative shares.
+	"""
+	nodes, children = tree(total_list)
+	out = []
+	pending = [("", budget)]
+	while pending:
+		parent, amount = pending.pop(0)
+		entries = [nodes[path] for path in children.get(parent, [])]
+		for path, alloc in allocate_waterfill(entries, weight, cap, amount):
+			out.append((path, alloc))
+			pending.append((path, alloc))
+	return out
+
+def top_request(total_list):
+	"""What the top level of the hierarchy asks for, altogether."""
+	nodes, children = tree(total_list)
+	return sum(nodes[path][3] for path in children.get("", []))
+
+def read_usage(groups, app):
+	"""
+	Total CPU time, in ns, consumed by the group the executor created for
+	app under groups: cpuacct.usage on cgroup v1, cpu.stat on v2.
+	"""
+	path = os.path.join(groups, app)
+	try:
+		return int(open(path + "/cpuacct.usage").read())
+	except (IOError, OSError, ValueError):
+		pass
+	try:
+		for line in open(path + "/cpu.stat"):
+			key, value = line.split()
+			if key == "usage_usec":
+				return int(value) * 1000
+	except (IOError, OSError, ValueError):
+		pass
+	return None
+
+def measure(total_list, groups, state, alpha, now=None):
+	"""
+	Update the smoothed consumption of every app, in shares of the whole
+	machine, from how much its usage counter grew since the last round.
+	Apps seen for the first time, or whose group cannot be read, have none.
+	"""
+	if now is None:
+		now = time.time()
+	ncpus = multiprocessing.cpu_count()
+	usage = state.setdefault("usage", {})
+	util = state.setdefault("util", {})
+	names = set(app[1] for app in total_list)
+	for name in list(usage):
+		if name not in names:
+			del usage[name]
+			util.pop(name, None)
+
+	for name in names:
+		cur = read_usage(groups, name)
+		if cur is None:
+			usage.pop(name, None)
+			util.pop(name, None)
+			continue
+		if name in usage:
+			prev, then = usage[name]
+			if now > then and cur >= prev:
+				used = (cur - prev) / ((now - then) * 1e9 * ncpus) * virtual
+				util[name] = alpha * used + (1 - alpha) * util.get(name, used)
+		usage[name] = [cur, now]
+	return util
+
+def feedback(total_list, limits, util, idle=0.5, busy=0.9, headroom=1.25, weight=1.0, cap=None):
+	"""
+	Move shares from apps consuming well under their allocation to apps
+	consuming nearly all of it. An idle app never drops below its request,
+	nor below its consumption plus some headroom. The shares taken are
+	water-filled by weight over the busy apps; whatever they cannot take
+	because of their caps goes back to the idle apps.
+	"""
+	shares = dict(limits)
+	weights = dict(zip([app[1] for app in total_list], app_weights(total_list, weight)))
+	caps = dict(zip([app[1] for app in total_list], app_caps(total_list, cap)))
+
+	idle_apps = []
+	busy_apps = []
+	for app in total_list:
+		name = app[1]
+		if name not in util:
+			continue
+		if util[name] < idle * shares[name]:
+			keep = max(app[3], int(math.ceil(util[name] * headroom)))
+			if keep < shares[name]:
+				idle_apps.append((name, keep))
+		elif util[name] >= busy * shares[name]:
+			busy_apps.append(name)
+	if not idle_apps or not busy_apps:
+		return limits
+
+	pool = sum(shares[name] - keep for name, keep in idle_apps)
+	floors = [shares[name] for name in busy_apps]
+	given = waterfill(sum(floors) + pool, floors,
+		[max(caps[name], shares[name]) for name in busy_apps],
+		[weights[name] for name in busy_apps])
+	left = pool - (sum(given) - sum(floors))
+	kept = waterfill(sum(keep for name, keep in idle_apps) + left,
+		[keep for name, keep in idle_apps],
+		[shares[name] for name, keep in idle_apps],
+		[1.0] * len(idle_apps))
+
+	for name, s in zip(busy_apps, given):
+		shares[name] = s
+	for (name, keep), s in zip(idle_apps, kept):
+		shares[name] = s
+	return [(name, shares[name]) for name, limit in limits]
+
+def parse_list(text):
+	"""Expand a "0-3,8" kernel CPU or node list."""
+	out = []
+	for part in text.strip().split(","):
+		if not part:
+			continue
+		if "-" in part:
+			lo, hi = part.split("-")
+			out.extend(range(int(lo), int(hi) + 1))
 		else:
-			if app[3] <= 50:
-				app[3] = app[3] + int((virtual - total) / elastic)
-			os.system("echo set_limit:"+app[1]+":cpu.shares:"+str(app[3]))
+			out.append(int(part))
+	return out
+
+def format_list(items):
+	"""The reverse of parse_list()."""
+	out = []
+	items = sorted(items)
+	i = 0
+	while i < len(items):
+		j = i
+		while j + 1 < len(items) and items[j + 1] == items[j] + 1:
+			j += 1
+		out.append(str(items[i]) if i == j else "%d-%d" % (items[i], items[j]))
+		i = j + 1
+	return ",".join(out)
+
+def topology():
+	"""The CPUs of every NUMA node, or a single node holding all of them."""
+	nodes = {}
+	for path in glob.glob("/sys/devices/system/node/node[0-9]*/cpulist"):
+		cpus = parse_list(open(path).read())
+		if cpus:
+			nodes[int(path.split("/")[-2][4:])] = cpus
+	if not nodes:
+		nodes[0] = list(range(multiprocessing.cpu_count()))
+	return nodes
+
+def place(total_list, nodes, reserve=1):
+	"""
+	CPU and memory node placement by the class= tag of every app:
+
+	critical	cores no other app is placed on, as many as its share of
+			the budget and at least one, all on the node with the
+			most free cores, and memory from that node only
+	batch		all batch apps packed together on as many cores as their
+			combined share of the budget, taken from the last nodes
+			first, and memory from those nodes only
+	anything else	every core not given away to critical apps
+
+	At least reserve cores are never given to critical apps. Returns
+	{app: (cpus, mems)} with kernel-style lists.
+
+	The cores of critical apps are theirs among the apps of the policy
+	only. The kernel's own exclusive cpusets would keep every other
+	cpuset off them too, but need the policy's group and every group
+	above it to own their CPUs exclusively, which is not the policy's
+	to decide.
+	"""
+	free = dict((n, list(cpus)) for n, cpus in nodes.items())
+	ncpus = sum(len(cpus) for cpus in nodes.values())
+	placement = {}
+
+	critical = [app for app in total_list if app[6].get("class") == "critical"]
+	for app in sorted(critical, key=lambda app: -app[3]):
+		node = max(sorted(free), key=lambda n: len(free[n]))
+		want = max(1, int(math.ceil(app[3] / virtual * ncpus)))
+		want = min(want, len(free[node]), sum(len(c) for c in free.values()) - reserve)
+		if want < 1:
+			break
+		placement[app[1]] = (format_list(free[node][:want]), str(node))
+		free[node] = free[node][want:]
+
+	shared = [c for n in sorted(free) for c in free[n]]
+	shared_nodes = format_list([n for n in free if free[n]])
+	batch = [app for app in total_list if app[6].get("class") == "batch"]
+	if batch:
+		want = max(1, int(math.ceil(sum(app[3] for app in batch) / virtual * len(shared))))
+		cpus, mems = [], []
+		for n in sorted(free, reverse=True):
+			take = free[n][-min(want - len(cpus), len(free[n])):] if want > len(cpus) else []
+			if take:
+				cpus.extend(take)
+				mems.append(n)
+		for app in batch:
+			placement[app[1]] = (format_list(cpus), format_list(mems))
+
+	for app in total_list:
+		if app[1] not in placement:
+			placement[app[1]] = (format_list(shared), shared_nodes)
+	return placement
+
+def load_state(path):
+	"""
+	The state kept between rounds: the limits last emitted, and for
+	--feedback the last usage counter readings and smoothed consumption.
+	Run once per round, the policy only has it with --state; the event
+	loop keeps it in memory all the same.
+	"""
+	state = {"limits": {}, "usage": {}, "util": {}}
+	if not path or not os.path.exists(path):
+		return state
+	try:
+		state.update(json.load(open(path)))
+	except ValueError:
+		pass
+	return state
+
+def save_state(path, state):
+	"""
+	Replace the state file at once, through a file of a name nobody can
+	guess or plant beforehand next to it.
+	"""
+	if not path:
+		return
+	fd, tmp = tempfile.mkstemp(prefix=os.path.basename(path) + ".",
+		dir=os.path.dirname(path) or ".")
+	try:
+		f = os.fdopen(fd, "w")
+		json.dump(state, f, sort_keys=True)
+		f.close()
+		os.rename(tmp, path)
+	except Exception:
+		os.unlink(tmp)
+		raise
+
+# The parts of the state that stand for what the groups hold
+EMITTED = ("limits", "cpus", "mems", "latency", "memory", "io")
+
+def group_ids(groups, names):
+	"""
+	The inode of every app's group that exists. cgroupfs does not give
+	the number of a removed group to the next one made, so a group made
+	anew has a new one.
+	"""
+	ids = {}
+	for name in names:
+		try:
+			ids[name] = os.stat(os.path.join(groups, name)).st_ino
+		except OSError:
+			pass
+	return ids
+
+def check_state(state, epoch, groups=None, names=()):
+	"""
+	Forget every value last emitted, so that all of them are emitted
+	again, if the groups may no longer hold them: the state is of another
+	epoch, say before the executor was restarted, or one of the groups
+	has been removed and made again since the last round.
+	"""
+	stale = state.get("epoch") != epoch
+	ids = {}
+	if groups:
+		ids = group_ids(groups, names)
+		seen = state.get("groups", {})
+		stale = stale or any(name in seen and seen[name] != ids[name] for name in ids)
+	if stale:
+		for key in EMITTED:
+			state[key] = {}
+	state["epoch"] = epoch
+	state["groups"] = ids
+
+def changed(limits, state, hysteresis):
+	"""
+	Keep only the limits that moved by more than the hysteresis band
+	since they were last emitted, and remember those. Apps that are gone
+	are forgotten, so they are emitted in full if they come back.
+	"""
+	out = []
+	for app, limit in limits:
+		if app not in state or abs(limit - state[app]) > hysteresis:
+			state[app] = limit
+			out.append((app, limit))
+	current = dict(limits)
+	for app in list(state):
+		if app not in current:
+			del state[app]
+	return out
+
+def memory_total():
+	"""MiB of RAM, the default memory budget."""
+	try:
+		for line in open("/proc/meminfo"):
+			if line.startswith("MemTotal:"):
+				return int(line.split()[1]) // 1024
+	except (IOError, OSError):
+		pass
+	return 1024
+
+def memory_limits(apps, args):
+	"""
+	Requests in MiB; the budget is water-filled into memory.high like
+	shares, and memory.max lets an app go that much further above it
+	before the OOM killer steps in.
+	"""
+	out = []
+	for app, high in allocate_tree(apps, args.memory_budget, args.weight):
+		hard = "max"
+		if args.memory_max_ratio:
+			hard = "%dM" % max(high, int(high * args.memory_max_ratio))
+		out.append((app + ":memory.high", "%dM" % high))
+		out.append((app + ":memory.max", hard))
+	return out
+
+def io_limits(apps, args):
+	"""
+	Requests in io.weight units; the budget is water-filled into io.weight,
+	and with --io-bandwidth also into a hard bandwidth slice on --io-device.
+	"""
+	out = []
+	for app, weight in allocate_tree(apps, args.io_budget, args.weight):
+		out.append((app + ":io.weight", "default %d" % min(max(weight, 1), 10000)))
+		if args.io_device and args.io_bandwidth:
+			bps = max(1, int(float(weight) / args.io_budget * args.io_bandwidth))
+			out.append((app + ":io.max", "%s rbps=%d wbps=%d" % (args.io_device, bps, bps)))
+	return out
+
+def forecast(total_list, state, method, alpha, beta, horizon, gamma=0.1):
+	"""
+	Per app demand forecasting over the series of its requests, by
+	exponential smoothing (ewma) or Holt's linear trend (holt), horizon
+	rounds ahead. Every app is then allocated for the larger of its
+	request and its forecast. The forecast made horizon rounds ago is
+	checked against this round's request, and the absolute relative
+	error, smoothed by gamma rather than the level's alpha, so that a
+	fast level does not hide how far off it is, is kept in the state as
+	"error", per app.
+
+	Raising a request only helps where the shares are also a hard cap,
+	as with mod_limit_cpu.py --hard-quota: work conserving shares already
+	hand whatever is left to the apps whose demand outgrew their request.
+	On sim_cpumin.py --bursty traces with --hard, it lowers the rounds
+	spent below demand from 0.39 to 0.32 under the equal allocator;
+	without --hard it gains nothing, and a little of the slack goes to
+	the wrong apps.
+	"""
+	models = state.setdefault("forecast", {})
+	seen = {}
+	out = []
+	for app in total_list:
+		actual = float(app[3])
+		model = models.get(app[1])
+		if model is None:
+			model = {"level": actual, "trend": 0.0, "pending": [], "error": 0.0}
+		else:
+			if len(model["pending"]) >= horizon:
+				err = abs(model["pending"].pop(0) - actual) / max(actual, 1.0)
+				model["error"] = gamma * err + (1 - gamma) * model["error"]
+			level = alpha * actual + (1 - alpha) * (model["level"] + model["trend"])
+			if method == "holt":
+				model["trend"] = beta * (level - model["level"]) + (1 - beta) * model["trend"]
+			model["level"] = level
+		predicted = max(0.0, model["level"] + horizon * model["trend"])
+		model["pending"].append(predicted)
+		seen[app[1]] = model
+		out.append(app[:3] + [max(app[3], int(math.ceil(predicted)))] + app[4:])
+	models.clear()
+	models.update(seen)
+	return out
+
+LATENCY_CLASSES = {
+	"critical": "interactive",
+	"interactive": "interactive",
+	"batch": "best-effort",
+	"best-effort": "best-effort",
+}
+
+def latency_limits(total_list, args):
+	"""
+	Wakeup-time protection by the class= tag. Interactive apps get a
+	uclamp.min boost; best-effort apps become cpu.idle groups, which only
+	run when nothing else wants the CPU, and may have their uclamp.max
+	lowered. Everything else is normal and gets neither.
+	"""
+	out = []
+	for app in total_list:
+		latency = LATENCY_CLASSES.get(app[6].get("class"), "normal")
+		boost, limit, idle = "0.00", "max", "0"
+		if latency == "interactive":
+			boost = "%.2f" % args.uclamp_interactive
+		elif latency == "best-effort":
+			limit = args.uclamp_batch
+			idle = "1"
+		out.append((app[1] + ":cpu.uclamp.min", boost))
+		out.append((app[1] + ":cpu.uclamp.max", limit))
+		out.append((app[1] + ":cpu.idle", idle))
+	return out
+
+def best_effort(total_list):
+	"""
+	The apps latency_limits() makes cpu.idle groups. The kernel refuses
+	cpu.shares and cpu.weight writes to those, so they get no shares.
+	"""
+	return set(app[1] for app in total_list
+		if LATENCY_CLASSES.get(app[6].get("class")) == "best-effort")
+
+def changed_values(items, state):
+	"""Like changed(), for values that are either the same or not."""
+	out = [(key, value) for key, value in items if state.get(key) != value]
+	state.clear()
+	state.update(items)
+	return out
+
+def run_round(total_list, args, state, out):
+	"""
+	Allocate for one round and write the score and changed limits. Apps
+	may ask for memory and io besides cpu, each balanced on its own budget.
+	Apps named by "/"-separated paths are allocated top-down, always by
+	water-filling, and without usage feedback.
+	"""
+	check_state(state, args.epoch, args.groups, [app[1] for app in total_list])
+	memory = [app for app in total_list if app[2] == "memory"]
+	io = [app for app in total_list if app[2] == "io"]
+	total_list = [app for app in total_list if app[2] not in ("memory", "io")]
+
+	hierarchical = [app for app in total_list if "/" in app[1]]
+	if hierarchical:
+		nodes, children = tree(total_list)
+		score = score_of([nodes[path] for path in children[""]])
+	else:
+		score = score_of(total_list)
+	if args.forecast != "none":
+		total_list = forecast(total_list, state, args.forecast, args.smooth, args.trend,
+			args.horizon, args.error_smooth)
+
+	kwargs = {}
+	if args.allocator == "waterfill":
+		kwargs = {"weight": args.weight, "cap": args.cap}
+
+	if hierarchical:
+		limits = allocate_tree(total_list, virtual, args.weight, args.cap)
 	else:
-		os.system("echo set_limit:"+app[1]+":cpu.shares:"+str(app[3]))
+		limits = allocate(total_list, args.allocator, **kwargs)[1]
+	if args.feedback and not hierarchical:
+		util = measure(total_list, args.feedback, state, args.alpha)
+		limits = feedback(total_list, limits, util, args.idle, args.busy,
+			weight=args.weight, cap=args.cap)
+
+	if top_request(memory) > args.memory_budget or top_request(io) > args.io_budget:
+		score = "-0.1"
+
+	out.write("score:" + score + "\n")
+	# An app leaving best-effort must be out of cpu.idle before its shares
+	if args.latency_classes:
+		for key, value in changed_values(latency_limits(total_list, args), state.setdefault("latency", {})):
+			out.write("set_limit:" + key + ":" + value + "\n")
+		idle = best_effort(total_list)
+		limits = [(app, limit) for app, limit in limits if app not in idle]
+	for app, limit in changed(limits, state["limits"], args.hysteresis):
+		out.write("set_limit:" + app + ":cpu.shares:" + str(limit) + "\n")
+	if args.placement:
+		placement = sorted(place(total_list, topology(), args.reserve).items())
+		cpus = [(app, p[0]) for app, p in placement]
+		for app, value in changed_values(cpus, state.setdefault("cpus", {})):
+			out.write("set_cpus:" + app + ":cpuset.cpus:" + value + "\n")
+		mems = [(app, p[1]) for app, p in placement]
+		for app, value in changed_values(mems, state.setdefault("mems", {})):
+			out.write("set_mems:" + app + ":cpuset.mems:" + value + "\n")
+	for resource, apps, limits in (("memory", memory, memory_limits), ("io", io, io_limits)):
+		for key, value in changed_values(limits(apps, args) if apps else [], state.setdefault(resource, {})):
+			out.write("set_limit:" + key + ":" + value + "\n")
+	out.flush()
+
+	save_state(args.state, state)
+
+class PressureTriggers:
+	"""
+	PSI triggers on the cpu.pressure file of every app's group, or on the
+	system-wide /proc/pressure/cpu for apps whose group has none. The kernel
+	signals POLLPRI at most once per window, when tasks stalled for more
+	than the threshold within it.
+	"""
+	def __init__(self, groups, stall, window, poller):
+		self.groups = groups
+		# The kernel wants the trigger NUL-terminated
+		self.trigger = ("some %d %d" % (stall, window)).encode() + b"\0"
+		self.poller = poller
+		self.fds = {}		# path -> fd
+		self.paths = {}		# fd -> path
+		self.failed = set()
+
+	def arm(self, path):
+		if path in self.fds or path in self.failed:
+			return
+		try:
+			fd = os.open(path, os.O_RDWR | os.O_NONBLOCK)
+			os.write(fd, self.trigger)
+		except (IOError, OSError) as e:
+			sys.stderr.write("%s: %s\n" % (path, e.strerror))
+			self.failed.add(path)
+			return
+		self.fds[path] = fd
+		self.paths[fd] = path
+		self.poller.register(fd, select.POLLPRI)
+
+	def drop(self, fd):
+		"""Stop watching fd, so that the next update() arms its path anew."""
+		path = self.paths.pop(fd)
+		del self.fds[path]
+		self.poller.unregister(fd)
+		try:
+			os.close(fd)
+		except OSError:
+			pass		# POLLNVAL, it was not open
+
+	def update(self, total_list):
+		"""Watch the groups of exactly the apps of this round."""
+		wanted = set()
+		for app in total_list:
+			path = os.path.join(self.groups, app[1], "cpu.pressure")
+			wanted.add(path if os.path.exists(path) else "/proc/pressure/cpu")
+		for path in list(self.fds):
+			if path not in wanted:
+				self.drop(self.fds[path])
+		for path in wanted:
+			self.arm(path)
+
+	def __contains__(self, fd):
+		return fd in self.paths
+
+def event_loop(args, state, out):
+	"""
+	Sleep in poll() on stdin and the PSI triggers. New requests on stdin
+	(a round ends with an empty line, or with whatever arrived together)
+	and CPU stalls past the threshold both re-run the allocation. Every
+	round of output ends with an empty line, for the executor to batch.
+	A trigger whose group went away polls ready with POLLERR for good, so
+	it is dropped instead, and armed again by the next round if the group
+	is there.
+	"""
+	fd = sys.stdin.fileno()
+	poller = select.poll()
+	poller.register(fd, select.POLLIN | select.POLLHUP)
+	triggers = PressureTriggers(args.pressure, args.stall, args.window, poller)
+	total_list = []
+	lines = []
+	pending = b""
+
+	while True:
+		rerun = False
+		for ready, events in poller.poll():
+			if ready in triggers:
+				if events & (select.POLLERR | select.POLLNVAL):
+					triggers.drop(ready)
+				else:
+					rerun = True
+				continue
+			data = os.read(fd, 65536)
+			if not data:
+				return
+			pending += data
+			new = pending.split(b"\n")
+			pending = new.pop()
+			for line in new:
+				if line.strip():
+					lines.append(line.decode())
+				elif lines:
+					total_list, lines = read_apps(lines), []
+					rerun = True
+			if lines and not select.select([fd], [], [], 0)[0]:
+				total_list, lines = read_apps(lines), []
+				rerun = True
+
+		if rerun and total_list:
+			triggers.update(total_list)
+			run_round(total_list, args, state, out)
+			out.write("\n")
+			out.flush()
+
+def parse_args(argv=None):
+	parser = argparse.ArgumentParser()
+	parser.add_argument("--state",
+		help="file keeping the limits last emitted between rounds, to emit only the ones that"
+			" changed; $CPUMIN_STATE by default, without either every limit is emitted every round")
+	parser.add_argument("--groups", metavar="GROUPS",
+		help="directory holding the apps' cgroups; with --state, emit everything again for"
+			" groups made anew; --feedback or --pressure by default")
+	parser.add_argument("--epoch",
+		help="emit everything again whenever this changes, e.g. when the executor restarts;"
+			" $CPUMIN_EPOCH by default")
+	parser.add_argument("--hysteresis", type=int, default=0,
+		help="only re-emit a limit that moved by more than this many shares")
+	parser.add_argument("--allocator", choices=sorted(ALLOCATORS), default="equal",
+		help="how the spare shares are divided, 'equal' is the original policy;"
+			" 'waterfill' honours weights and never overshoots the budget")
+	parser.add_argument("--weight", type=float, default=1.0,
+		help="waterfill weight of apps that do not give one")
+	parser.add_argument("--cap", type=int, default=int(virtual),
+		help="waterfill cap, in shares, of apps that do not give one")
+	parser.add_argument("--feedback", metavar="GROUPS",
+		help="directory holding the apps' cgroups; move shares from idle to busy apps by measured usage;"
+			" needs --state unless --pressure keeps the policy running")
+	parser.add_argument("--alpha", type=float, default=0.5,
+		help="smoothing factor of the measured usage, 1 means no smoothing")
+	parser.add_argument("--idle", type=float, default=0.5,
+		help="apps using less than this fraction of their shares give some up")
+	parser.add_argument("--busy", type=float, default=0.9,
+		help="apps using at least this fraction of their shares get more")
+	parser.add_argument("--forecast", choices=["none", "ewma", "holt"], default="none",
+		help="allocate for the larger of the request and its forecast, only of use with"
+			" the executor's --hard-quota; needs --state unless --pressure keeps the policy running")
+	parser.add_argument("--horizon", type=int, default=1,
+		help="rounds ahead to forecast")
+	parser.add_argument("--smooth", type=float, default=0.5,
+		help="forecast level smoothing factor")
+	parser.add_argument("--trend", type=float, default=0.3,
+		help="holt trend smoothing factor")
+	parser.add_argument("--error-smooth", type=float, default=0.1,
+		help="smoothing factor of the forecast error kept in the state")
+	parser.add_argument("--latency-classes", action="store_true",
+		help="also emit uclamp and cpu.idle by the class= tag: interactive (or critical), best-effort (or batch) or normal")
+	parser.add_argument("--uclamp-interactive", type=float, default=20.0,
+		help="cpu.uclamp.min percentage of interactive apps")
+	parser.add_argument("--uclamp-batch", default="max",
+		help="cpu.uclamp.max of best-effort apps")
+	parser.add_argument("--placement", action="store_true",
+		help="also emit cpuset placement by the class= tag: critical, batch or anything else")
+	parser.add_argument("--reserve", type=int, default=1,
+		help="cores that are never given to critical apps")
+	parser.add_argument("--memory-budget", type=int, default=memory_total(),
+		help="MiB divided among the apps asking for memory, all of RAM by default")
+	parser.add_argument("--memory-max-ratio", type=float, default=1.25,
+		help="memory.max as a multiple of memory.high, 0 for no hard limit")
+	parser.add_argument("--io-budget", type=int, default=1000,
+		help="io.weight divided among the apps asking for io")
+	parser.add_argument("--io-device", metavar="MAJ:MIN",
+		help="block device of the --io-bandwidth limits")
+	parser.add_argument("--io-bandwidth", type=int, metavar="BYTES",
+		help="also cap every app at its slice of this many bytes/s each way with io.max")
+	parser.add_argument("--pressure", metavar="GROUPS",
+		help="stay running, and also rebalance when PSI reports CPU stalls in the apps' cgroups under GROUPS")
+	parser.add_argument("--stall", type=int, default=200000,
+		help="usecs of stall per window that trigger a rebalance")
+	parser.add_argument("--window", type=int, default=2000000,
+		help="PSI window in usecs, unprivileged triggers need a multiple of 2s")
+	return parser.parse_args(argv)
+
+def main(args, stdin=sys.stdin, stdout=sys.stdout):
+	"""One round, or the event loop, with the given command line arguments."""
+	if args.state is None:
+		args.state = os.environ.get("CPUMIN_STATE", "")
+	if args.epoch is None:
+		args.epoch = os.environ.get("CPUMIN_EPOCH", "")
+	if args.groups is None:
+		args.groups = args.feedback or args.pressure
+	state = load_state(args.state)
+	if args.pressure:
+		if not args.feedback:
+			args.feedback = args.pressure
+		event_loop(args, state, stdout)
+	else:
+		run_round(read_apps(stdin), args, state, stdout)
+
+if __name__ == '__main__':
+	main(parse_args())
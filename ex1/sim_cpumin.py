@@ -0,0 +1,262 @@
+#!/usr/bin/python
+
+# Offline simulator for cpu.shares policies: replays app demand traces
+# through a policy script, applies the limits it emits the way the
+# executor would, and models how CFS then divides the machine.
+#
+# A trace is a list of rounds, separated by empty lines, of
+# "app:request:demand[:field...]" lines, the same as the scenarios of
+# eval_cpumin.py, read by cpumin_model.py. The policy is shown
+# "policy:app:cpu:request[:field...]", never the demand. Traces come from
+# files, or are generated with --random.
+#
+# CFS is modelled as in cpumin_model.py, as work conserving: the whole
+# machine, worth the policy's budget of shares, is divided in proportion to
+# cpu.shares, and whatever an app cannot use goes to the others. Apps
+# the policy never gave a limit have the cgroup default of 1024. With
+# --hard, every app is also capped at its shares, as the executor's
+# --hard-quota does with the same budget.
+#
+# Per policy this prints the mean score line of the policy itself, and:
+#	coverage	mean fraction of each app's demand it got
+#	util		fraction of the machine in use, out of what was demanded
+#	jain		Jain's fairness index of the coverages, 1 is perfectly fair
+#	starved		apps that got less than half of min(request, demand)
+#	below		fraction of app rounds spent below demand
+#	writes		set_limit lines emitted per round
+#	fcerr		forecast error the policy kept in its state, if any
+#
+# A policy is a command line. A Python script with parse_args(argv) and
+# main(args, stdin, stdout), like mod_policy_cpumin.py, is run in-process unless
+# --subprocess is given; anything else is run once per round. Either way
+# it gets a fresh CPUMIN_STATE file for every trace.
+#
+# Usage: sim_cpumin.py [-p POLICY]... [--random N [--bursty]] [trace...]
+
+import sys
+import os
+import glob
+import shlex
+import random
+import copy
+import argparse
+import json
+import tempfile
+import subprocess
+
+try:
+	from StringIO import StringIO
+except ImportError:
+	from io import StringIO
+
+import cpumin_model
+
+budget = 2000.0
+default_shares = 1024
+# The state file is rewritten every round, keep it in memory if possible
+scratch = '/dev/shm' if os.path.isdir('/dev/shm') else None
+
+def load_module(path):
+	name = os.path.splitext(os.path.basename(path))[0]
+	try:
+		import importlib.util
+		spec = importlib.util.spec_from_file_location(name, path)
+		module = importlib.util.module_from_spec(spec)
+		spec.loader.exec_module(module)
+	except ImportError:
+		import imp
+		module = imp.load_source(name, path)
+	return module
+
+class Policy:
+	"""Runs one round of a policy command and returns its output lines."""
+	def __init__(self, spec, subprocess_only=False):
+		self.spec = spec
+		self.argv = shlex.split(spec)
+		self.module = None
+		if self.argv[0].endswith('.py'):
+			if not subprocess_only:
+				module = load_module(self.argv[0])
+				if hasattr(module, 'parse_args') and hasattr(module, 'main'):
+					self.module = module
+					self.args = module.parse_args(self.argv[1:])
+			if self.module is None:
+				self.argv.insert(0, sys.executable)
+
+	def __call__(self, lines):
+		if self.module:
+			# main() may fill in defaults from the environment, start afresh
+			out = StringIO()
+			self.module.main(copy.copy(self.args), lines, out)
+			return out.getvalue().splitlines()
+		p = subprocess.Popen(self.argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+			universal_newlines=True)
+		out = p.communicate(''.join(line + '\n' for line in lines))[0]
+		return out.splitlines()
+
+def jain(values):
+	if not values:
+		return 1.0
+	sq = sum(v * v for v in values)
+	return sum(values) ** 2 / (len(values) * sq) if sq else 1.0
+
+def simulate(policy, rounds, hard=False):
+	"""Replay the rounds of one trace, return the mean of every metric."""
+	fd, state = tempfile.mkstemp(prefix='cpumin-sim', dir=scratch)
+	os.close(fd)
+	os.unlink(state)
+	saved = os.environ.get('CPUMIN_STATE')
+	os.environ['CPUMIN_STATE'] = state
+
+	shares = {}
+	totals = dict.fromkeys(METRICS, 0.0)
+	try:
+		for apps in rounds:
+			lines = ['policy:%s:cpu:%s' % (a[0], ':'.join([a[1]] + a[3:])) for a in apps]
+			# Groups of apps that left are removed, new ones start at the default
+			shares = dict((a[0], shares.get(a[0], default_shares)) for a in apps)
+			for line in policy(lines):
+				f = line.split(':')
+				if f[0] == 'score':
+					totals['score'] += float(f[1])
+				elif f[0] == 'set_limit' and f[1] in shares and f[2] == 'cpu.shares':
+					shares[f[1]] = int(f[3])
+					totals['writes'] += 1
+
+			demands = dict((a[0], float(a[2])) for a in apps)
+			if hard:
+				got = cpumin_model.cfs(shares, dict((app, min(d, shares[app])) for app, d in demands.items()), budget)
+			else:
+				got = cpumin_model.cfs(shares, demands, budget)
+			coverage = [min(got[app], d) / d if d else 1.0 for app, d in demands.items()]
+			totals['coverage'] += sum(coverage) / len(coverage)
+			totals['util'] += sum(got.values()) / min(budget, sum(demands.values()) or 1.0)
+			totals['jain'] += jain(coverage)
+			totals['starved'] += sum(1 for a in apps
+				if got[a[0]] < 0.5 * min(float(a[1]), demands[a[0]]))
+			totals['below'] += sum(1 for app in demands
+				if got[app] < 0.99 * demands[app]) / float(len(demands))
+		try:
+			models = json.load(open(state)).get('forecast', {})
+			if models:
+				totals['fcerr'] = len(rounds) * sum(m['error'] for m in models.values()) / len(models)
+		except (IOError, OSError, ValueError):
+			pass
+	finally:
+		if saved is None:
+			del os.environ['CPUMIN_STATE']
+		else:
+			os.environ['CPUMIN_STATE'] = saved
+		if os.path.exists(state):
+			os.unlink(state)
+
+	n = float(len(rounds))
+	return dict((k, v / n) for k, v in totals.items())
+
+def synthetic(rng, nrounds):
+	"""
+	A random trace: apps come and go, requests drift, and demand is
+	anywhere from idle to several times the request. Some apps give
+	weights, and the requests overshoot the budget now and then.
+	"""
+	apps = {}
+	rounds = []
+	serial = 0
+	for r in range(nrounds):
+		while len(apps) < 2 or (len(apps) < 16 and rng.random() < 0.3):
+			request = rng.choice([rng.randint(10, 50), rng.randint(50, 400)])
+			weight = [str(rng.choice([1, 2, 4]))] if rng.random() < 0.3 else []
+			apps['app%d' % serial] = [request, weight]
+			serial += 1
+		for name in list(apps):
+			if len(apps) > 2 and rng.random() < 0.1:
+				del apps[name]
+		lines = []
+		for name in sorted(apps):
+			request, weight = apps[name]
+			request = max(1, int(request * rng.uniform(0.8, 1.25)))
+			apps[name][0] = request
+			demand = int(request * rng.choice([0.1, 0.5, 1.0, 2.0, 4.0]) * rng.uniform(0.8, 1.2))
+			lines.append([name, str(request), str(demand)] + weight)
+		rounds.append(lines)
+	return rounds
+
+def bursty(rng, nrounds):
+	"""
+	A random trace of bursty apps: periodic spikes, ramps up and down,
+	and on/off phases over a steady base. The request an app reports is
+	what it used in the previous round, as a monitor measuring usage
+	would, so it always lags the demand by a round.
+	"""
+	apps = []
+	for i in range(rng.randint(3, 10)):
+		kind = rng.choice(['spike', 'ramp', 'onoff', 'steady'])
+		apps.append(('app%d' % i, kind, rng.randint(20, 150), rng.randint(100, 600), rng.randint(3, 8)))
+	rounds = []
+	last = {}
+	for r in range(nrounds):
+		lines = []
+		for name, kind, base, peak, period in apps:
+			phase = r % period
+			if kind == 'spike':
+				demand = base + (peak if phase == 0 else 0)
+			elif kind == 'ramp':
+				demand = base + peak * min(phase, period - phase) // (period // 2 or 1)
+			elif kind == 'onoff':
+				demand = base + (peak if (r // period) % 2 else 0)
+			else:
+				demand = base
+			demand = max(1, int(demand * rng.uniform(0.9, 1.1)))
+			lines.append([name, str(last.get(name, demand)), str(demand)])
+			last[name] = demand
+		rounds.append(lines)
+	return rounds
+
+METRICS = ['score', 'coverage', 'util', 'jain', 'starved', 'below', 'writes', 'fcerr']
+
+def report(name, results):
+	n = float(len(results))
+	mean = dict((k, sum(r[k] for r in results) / n) for k in METRICS)
+	worst = min(r['coverage'] for r in results)
+	sys.stdout.write('%-40s' % name[-40:] + ''.join('%9.3f' % mean[k] for k in METRICS) +
+		'%9.3f\n' % worst)
+
+if __name__ == '__main__':
+	here = os.path.dirname(os.path.abspath(__file__))
+	cpumin = os.path.join(here, 'mod_policy_cpumin.py')
+	parser = argparse.ArgumentParser()
+	parser.add_argument('-p', '--policy', action='append', dest='policies',
+		help='policy command line, may be repeated; the equal and waterfill cpumin allocators by default')
+	parser.add_argument('--random', type=int, metavar='N',
+		help='simulate N random traces instead of the scenario files')
+	parser.add_argument('--bursty', action='store_true',
+		help='random traces of bursty apps whose requests lag their demand')
+	parser.add_argument('--rounds', type=int, default=20,
+		help='rounds of every random trace')
+	parser.add_argument('--seed', type=int, default=1,
+		help='random trace seed')
+	parser.add_argument('--hard', action='store_true',
+		help='cap every app at its shares, like mod_limit_cpu.py --hard-quota')
+	parser.add_argument('--subprocess', action='store_true',
+		help='run Python policies once per round too, as the real harness does')
+	parser.add_argument('traces', nargs='*',
+		help='trace files, scenarios/*.txt by default')
+	args = parser.parse_args()
+
+	specs = args.policies or [cpumin + ' --allocator equal', cpumin + ' --allocator waterfill']
+	policies = [Policy(spec, args.subprocess) for spec in specs]
+
+	if args.random:
+		rng = random.Random(args.seed)
+		generate = bursty if args.bursty else synthetic
+		traces = [('%s x%d' % (generate.__name__, args.random),
+			[generate(rng, args.rounds) for i in range(args.random)])]
+	else:
+		paths = args.traces or sorted(glob.glob(os.path.join(here, 'scenarios', '*.txt')))
+		traces = [(os.path.basename(path), [cpumin_model.load(path)]) for path in paths]
+
+	sys.stdout.write('%-40s' % 'trace / policy' + ''.join('%9s' % k for k in METRICS) + '%9s\n' % 'worst')
+	for name, group in traces:
+		sys.stdout.write(name + '\n')
+		for policy in policies:
+			report('  ' + os.path.basename(policy.spec), [simulate(policy, rounds, args.hard) for rounds in group])
@@ -0,0 +1,148 @@
+#!/usr/bin/python
+
+# Pipes the output of mod_policy_cpumin.py through mod_limit_cpu.py, on
+# both cgroup backends, against a scratch directory standing in for
+# /sys/fs/cgroup, and checks that every file ends up holding what the
+# policy decided.
+#
+# The policy writes "<command>:<app>:<file>:<value>" lines; the harness
+# hands them to the executor as "<command>:<policy>:<controller>:<app>:
+# <file>:<value>", which harness() below does the same way.
+#
+# Usage: test_cpumin.py [-v]
+
+import os
+import shutil
+import tempfile
+import unittest
+
+try:
+	from StringIO import StringIO
+except ImportError:
+	from io import StringIO
+
+import mod_policy_cpumin as policy
+import mod_limit_cpu as executor
+
+APPS = [
+	"cpumin:web:cpu:500:class=critical",
+	"cpumin:crunch:cpu:300:class=batch",
+	"cpumin:other:cpu:200",
+]
+NODES = {0: [0, 1, 2, 3], 1: [4, 5, 6, 7]}
+
+# The files cgroupfs would give the groups of the test, and no others
+CGROUP_FILES = ["cgroup.procs", "tasks", "cgroup.subtree_control",
+	"cpu.shares", "cpu.weight", "cpuset.cpus", "cpuset.mems"]
+
+def scratch(backend):
+	"""backend, on plain directories that lack the kernel's files."""
+	class Scratch(backend):
+		def write(self, path, value):
+			if os.path.basename(path) in CGROUP_FILES and not os.path.exists(path):
+				open(path, "a").close()
+			backend.write(self, path, value)
+	return Scratch
+
+def harness(line, name="cpumin"):
+	"""The executor command for one line of policy output."""
+	fields = line.split(":")
+	controller = fields[2].split(".")[0]
+	return ":".join([fields[0], name, controller] + fields[1:])
+
+def written(path):
+	"""The values written to a scratch cgroup file, in order."""
+	f = open(path)
+	try:
+		return f.read().splitlines()
+	finally:
+		f.close()
+
+def last(path):
+	return written(path)[-1]
+
+class Pipeline(unittest.TestCase):
+	def setUp(self):
+		self.scratch = tempfile.mkdtemp()
+		self.topology = policy.topology
+		policy.topology = lambda: NODES
+
+	def tearDown(self):
+		policy.topology = self.topology
+		shutil.rmtree(self.scratch)
+
+	def run_policy(self, root, cpuset_root, backend):
+		out = StringIO()
+		args = policy.parse_args(["--state", "", "--placement"])
+		policy.main(args, StringIO("\n".join(APPS) + "\n"), out)
+		lines = [l for l in out.getvalue().splitlines() if l and not l.startswith("score:")]
+		batch = [executor.parse("create:cpumin:cpu:" + app.split(":")[1]) for app in APPS]
+		batch += [executor.parse(harness(line)) for line in lines]
+		scratch(backend)(root, cpuset_root=cpuset_root).run(batch)
+		apps = policy.read_apps(APPS)
+		return dict(policy.allocate(apps)[1]), policy.place(apps, NODES)
+
+	def test_v1(self):
+		root = os.path.join(self.scratch, "cpu", "")
+		cpuset_root = os.path.join(self.scratch, "cpuset", "")
+		os.makedirs(root)
+		os.makedirs(cpuset_root)
+		for name, value in (("cpuset.cpus", "0-7"), ("cpuset.mems", "0-1")):
+			f = open(cpuset_root + name, "w")
+			f.write(value + "\n")
+			f.close()
+		# Tasks added before the app was first placed
+		os.makedirs(root + "cpumin/web")
+		f = open(root + "cpumin/web/tasks", "w")
+		f.write("101\n102\n")
+		f.close()
+		shares, placement = self.run_policy(root, cpuset_root, executor.NativeExecutor)
+		for app, p in placement.items():
+			self.assertEqual(last(root + "cpumin/" + app + "/cpu.shares"), str(shares[app]))
+			self.assertEqual(last(cpuset_root + "cpumin/" + app + "/cpuset.cpus"), p[0])
+			self.assertEqual(last(cpuset_root + "cpumin/" + app + "/cpuset.mems"), p[1])
+		self.assertEqual(written(cpuset_root + "cpumin/web/tasks"), ["101", "102"])
+
+	def test_v2(self):
+		root = os.path.join(self.scratch, "unified", "")
+		os.makedirs(root)
+		shares, placement = self.run_policy(root, None, executor.NativeV2Executor)
+		for app, p in placement.items():
+			self.assertEqual(last(root + "cpumin/" + app + "/cpu.weight"),
+				str(executor.shares_to_weight(shares[app])))
+			self.assertEqual(last(root + "cpumin/" + app + "/cpuset.cpus"), p[0])
+			self.assertEqual(last(root + "cpumin/" + app + "/cpuset.mems"), p[1])
+		self.assertTrue("+cpuset" in written(root + "cgroup.subtree_control"))
+
+TREE = [
+	"cpumin:t1/s1:cpu:100",
+	"cpumin:t1/s2:cpu:100",
+	"cpumin:t2/s1:cpu:150",
+	"cpumin:t2/s2:cpu:50",
+]
+
+class Delta(unittest.TestCase):
+	def setUp(self):
+		self.scratch = tempfile.mkdtemp()
+
+	def tearDown(self):
+		shutil.rmtree(self.scratch)
+
+	def emitted(self, apps):
+		out = StringIO()
+		args = policy.parse_args(["--state", os.path.join(self.scratch, "state")])
+		policy.main(args, StringIO("\n".join(apps) + "\n"), out)
+		return dict((l.split(":")[1], int(l.split(":")[3]))
+			for l in out.getvalue().splitlines() if l.startswith("set_limit:"))
+
+	def test_siblings(self):
+		before = dict(policy.allocate_tree(policy.read_apps(TREE)))
+		self.assertEqual(self.emitted(TREE), before)
+		grown = ["cpumin:t1/s1:cpu:300"] + TREE[1:]
+		after = dict(policy.allocate_tree(policy.read_apps(grown)))
+		moved = dict((app, s) for app, s in after.items() if s != before[app])
+		self.assertTrue("t2" in moved)
+		self.assertEqual(self.emitted(grown), moved)
+
+if __name__ == '__main__':
+	unittest.main()
@@ -13,7 +13,10 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <pwd.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
@@ -26,6 +29,7 @@
 #include <termios.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -368,11 +372,12 @@ static int tty_close(void)
 	return 0;
 }
 
+static int tty_setup(void);
+
 /* Open and initialize a terminal line. */
 static int tty_open(char *name)
 {
 	int fd;
-	int ret;
 	int saved_errno;
 	char pathbuf[PATH_MAX];
 	register char *path_open, *path_lock;
@@ -412,6 +417,18 @@ static int tty_open(char *name)
 		tty_fd = 0;
 	}
 
+	return tty_setup();
+}
+
+/*
+ * Bring the already open terminal line in tty_fd to 57600 8N1 raw mode
+ * and attach the Lunix line discipline to it.
+ */
+static int tty_setup(void)
+{
+	int ret;
+	int saved_errno;
+
 	/* Fetch the current state of the terminal. */
 	if (tty_get_state(&tty_before) < 0) {
 		saved_errno = errno;
@@ -463,33 +480,420 @@ static int tty_open(char *name)
 	return 0;
 }
 
+/*
+ * Built-in ingest modes.
+ *
+ * Instead of relaying a remote gateway into a pts with socat and then
+ * attaching the discipline to it, open a pseudo-terminal pair ourselves,
+ * attach the discipline to the slave side and push the incoming bytes
+ * straight into the master side. When possible the data are spliced
+ * from the socket into the pty through a pipe, without ever being
+ * copied to userspace.
+ */
+#define INGEST_BUFSZ		(1 << 16)	/* bytes per read/splice	*/
+#define INGEST_PIPESZ		(1 << 20)	/* requested splice pipe size	*/
+#define INGEST_RETRY_MAX	30		/* max reconnect delay, in sec	*/
+#define INGEST_SOCK_RCVBUF	(1 << 20)	/* socket receive buffer	*/
+
+enum ingest_mode { INGEST_NONE = 0, INGEST_CONNECT, INGEST_LISTEN, INGEST_REPLAY };
+
+enum ingest_mode ingest_mode = INGEST_NONE;
+int pty_master = -1;
+int ingest_count_packets = 0;	/* scan for frame bytes, disables splice */
+
+struct {
+	unsigned long long bytes;	/* total bytes pushed into the pty	*/
+	unsigned long long delims;	/* 0x7E frame delimiters seen		*/
+	unsigned long long conns;	/* connections / replay passes		*/
+	unsigned long long splices;	/* bytes moved without a copy		*/
+	struct timeval start;
+} ingest_stats;
+
+/* Print the byte and packet counters. */
+static void ingest_report(void)
+{
+	struct timeval now;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - ingest_stats.start.tv_sec) +
+		(now.tv_usec - ingest_stats.start.tv_usec) / 1e6;
+	if (secs <= 0)
+		secs = 1e-6;
+
+	fprintf(stderr, "lunix-attach: %llu bytes (%llu spliced), ",
+		ingest_stats.bytes, ingest_stats.splices);
+	if (ingest_count_packets)
+		fprintf(stderr, "%llu packets, ", ingest_stats.delims / 2);
+	fprintf(stderr, "%llu connections in %.2f s, %.1f KiB/s\n",
+		ingest_stats.conns, secs, ingest_stats.bytes / 1024.0 / secs);
+}
+
+/* Open a pseudo-terminal pair and set the discipline on its slave side. */
+static int pty_open(void)
+{
+	int fd;
+	char *name;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) {
+		perror("pty_open: posix_openpt");
+		return -1;
+	}
+	if (grantpt(fd) < 0 || unlockpt(fd) < 0 || (name = ptsname(fd)) == NULL) {
+		perror("pty_open: cannot unlock pty");
+		close(fd);
+		return -1;
+	}
+	if ((tty_fd = open(name, O_RDWR | O_NOCTTY)) < 0) {
+		fprintf(stderr, "pty_open(%s, RW): %s\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	pty_master = fd;
+	fprintf(stderr, "pty_open: %s (fd=%d) ", name, tty_fd);
+
+	return tty_setup();
+}
+
+/* Split "host:port" or "port" in place. */
+static void ingest_split(char *spec, char **host, char **port)
+{
+	char *p;
+
+	if ((p = strrchr(spec, ':')) == NULL) {
+		*host = NULL;
+		*port = spec;
+	} else {
+		*p = '\0';
+		*host = (*spec) ? spec : NULL;
+		*port = p + 1;
+	}
+}
+
+/* Open a TCP socket to host:port, or a listening one if passive is set. */
+static int ingest_socket(const char *host, const char *port, int passive)
+{
+	int fd, ret, one = 1, rcvbuf = INGEST_SOCK_RCVBUF;
+	struct addrinfo hints, *res, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "ingest: %s:%s: %s\n", host ? host : "*", port,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	fd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		(void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		if (passive) {
+			(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 1) == 0)
+				break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+		fprintf(stderr, "ingest: %s %s:%s: %s\n", passive ? "listen on" : "connect to",
+			host ? host : "*", port, strerror(errno));
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/* Write all of buf to the pty master, counting frame delimiters. */
+static int ingest_write(const char *buf, size_t cnt)
+{
+	size_t i;
+	ssize_t ret;
+
+	if (ingest_count_packets)
+		for (i = 0; i < cnt; i++)
+			if ((unsigned char)buf[i] == 0x7E)
+				ingest_stats.delims++;
+
+	while (cnt > 0) {
+		ret = write(pty_master, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		cnt -= ret;
+	}
+
+	return 0;
+}
+
+/* Sleep as long as needed to keep the average rate at rate bytes/sec. */
+static void ingest_pace(unsigned long rate, unsigned long long sent,
+	struct timeval *t0)
+{
+	struct timeval now;
+	long long due, elapsed;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - t0->tv_sec) * 1000000LL + (now.tv_usec - t0->tv_usec);
+	due = sent * 1000000ULL / rate;
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
+/*
+ * Move everything from src into the pty master until EOF,
+ * at most rate bytes/sec if rate is non-zero.
+ * Returns 0 on EOF, a negative errno on failure.
+ */
+static int ingest_relay(int src, unsigned long rate)
+{
+	static char buf[INGEST_BUFSZ];
+	static int pfd[2] = { -1, -1 };
+	static int can_splice = 1;
+	unsigned long long sent;
+	struct timeval t0;
+	size_t chunk;
+	ssize_t n, m, r;
+	int ret;
+
+	if (ingest_count_packets)
+		can_splice = 0;
+	if (can_splice && pfd[0] < 0) {
+		if (pipe(pfd) < 0)
+			can_splice = 0;
+		else
+			(void) fcntl(pfd[1], F_SETPIPE_SZ, INGEST_PIPESZ);
+	}
+
+	chunk = INGEST_BUFSZ;
+	if (rate && rate / 100 < chunk)
+		chunk = (rate / 100) ? rate / 100 : 1;
+
+	sent = 0;
+	gettimeofday(&t0, NULL);
+	for (;;) {
+		if (can_splice) {
+			n = splice(src, NULL, pfd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && errno == EINVAL) {
+				/* The source cannot be spliced, copy from now on */
+				can_splice = 0;
+				continue;
+			}
+			for (m = n; m > 0; m -= ret) {
+				ret = splice(pfd[0], NULL, pty_master, NULL, m, SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (ret > 0) {
+					ingest_stats.splices += ret;
+					continue;
+				}
+				if (ret < 0 && errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				if (ret < 0 && errno != EINVAL)
+					return -errno;
+				/* The pty cannot be spliced to, drain the pipe by hand */
+				can_splice = 0;
+				while (m > 0) {
+					if ((r = read(pfd[0], buf, MIN(m, sizeof(buf)))) <= 0)
+						return r ? -errno : -EIO;
+					if ((ret = ingest_write(buf, r)) < 0)
+						return ret;
+					m -= r;
+				}
+				break;
+			}
+		} else {
+			n = read(src, buf, chunk);
+			if (n > 0 && (ret = ingest_write(buf, n)) < 0)
+				return ret;
+		}
+
+		if (n == 0)
+			return 0;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ingest_stats.bytes += n;
+		sent += n;
+		if (rate)
+			ingest_pace(rate, sent, &t0);
+	}
+}
+
+/* Connect to host:port, relay until EOF and reconnect, forever. */
+static void ingest_connect_loop(char *spec)
+{
+	int fd, ret, delay;
+	char *host, *port;
+
+	ingest_split(spec, &host, &port);
+	for (delay = 1;; ) {
+		fprintf(stderr, "Connecting to %s:%s\n", host ? host : "localhost", port);
+		if ((fd = ingest_socket(host, port, 0)) >= 0) {
+			ingest_stats.conns++;
+			delay = 1;
+			ret = ingest_relay(fd, 0);
+			fprintf(stderr, "Connection closed: %s\n",
+				ret ? strerror(-ret) : "end of stream");
+			close(fd);
+			ingest_report();
+		}
+		fprintf(stderr, "Reconnecting in %d s...\n", delay);
+		sleep(delay);
+		delay = MIN(delay * 2, INGEST_RETRY_MAX);
+	}
+}
+
+/* Listen on [host:]port and relay one feeder at a time, forever. */
+static void ingest_listen_loop(char *spec)
+{
+	int sd, fd, ret;
+	char *host, *port;
+
+	ingest_split(spec, &host, &port);
+	if ((sd = ingest_socket(host, port, 1)) < 0)
+		return;
+	for (;;) {
+		fprintf(stderr, "Waiting for a feeder on %s:%s...\n", host ? host : "*", port);
+		if ((fd = accept(sd, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return;
+		}
+		ingest_stats.conns++;
+		ret = ingest_relay(fd, 0);
+		fprintf(stderr, "Feeder went away: %s\n",
+			ret ? strerror(-ret) : "end of stream");
+		close(fd);
+		ingest_report();
+	}
+}
+
+/* Push a capture file through the discipline once, at rate bytes/sec or flat out. */
+static int ingest_replay(const char *path, unsigned long rate)
+{
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ingest_stats.conns++;
+	ret = ingest_relay(fd, rate);
+	close(fd);
+	if (ret < 0)
+		fprintf(stderr, "replay: %s: %s\n", path, strerror(-ret));
+	ingest_report();
+
+	return ret;
+}
+
 /* Catch any signals. */
 static void sig_catch(int sig)
 {
+	if (ingest_mode != INGEST_NONE)
+		ingest_report();
 	tty_close();
 	exit(0);
 }
 
+/* Report the counters on SIGUSR1, keep going. */
+static void sig_report(int sig)
+{
+	ingest_report();
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s tty_line\n"
+		"       %s [-p] -c host:port\n"
+		"       %s [-p] -l [host:]port\n"
+		"       %s [-p] [-R bytes_per_sec] -r capture_file\n"
+		"where tty_line is the TTY on which to set the Lunix line discipline.\n"
+		"With -c, -l or -r the discipline is set on a private pty, which is fed\n"
+		"from a TCP connection [-c: connect and reconnect, -l: accept feeders],\n"
+		"or from a capture file [-r, at the -R rate, or as fast as possible].\n"
+		"-p counts XMesh packets, at the cost of copying every byte.\n"
+		"Send SIGUSR1 to print the byte and packet counters.\n\n",
+		argv0, argv0, argv0, argv0);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr,
-			"Usage: %s tty_line\n"
-			"where tty_line is the TTY on which to set the Lunix line discipline.\n\n",
-			argv[0]);
-		exit(1);
+	int opt;
+	char *spec = NULL;
+	unsigned long rate = 0;
+
+	while ((opt = getopt(argc, argv, "c:l:r:R:p")) != -1) {
+		switch (opt) {
+		case 'c':
+		case 'l':
+		case 'r':
+			if (ingest_mode != INGEST_NONE)
+				usage(argv[0]);
+			ingest_mode = (opt == 'c') ? INGEST_CONNECT :
+				(opt == 'l') ? INGEST_LISTEN : INGEST_REPLAY;
+			spec = optarg;
+			break;
+		case 'R':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			ingest_count_packets = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
+	if (argc - optind != ((ingest_mode == INGEST_NONE) ? 1 : 0))
+		usage(argv[0]);
 	
-	if (tty_open(argv[1]) < 0)
-		return 1;
-	
-	fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
-		argv[1]);
+	if (ingest_mode == INGEST_NONE) {
+		if (tty_open(argv[optind]) < 0)
+			return 1;
+		fprintf(stderr, "Line discipline set on %s, press ^C to release the TTY...\n",
+			argv[optind]);
+	} else {
+		if (pty_open() < 0)
+			return 1;
+		fprintf(stderr, "Line discipline set on private pty, press ^C to release it...\n");
+		gettimeofday(&ingest_stats.start, NULL);
+	}
 	
   	(void) signal(SIGHUP, sig_catch);
   	(void) signal(SIGINT, sig_catch);
   	(void) signal(SIGQUIT, sig_catch);
   	(void) signal(SIGTERM, sig_catch);
+	(void) signal(SIGUSR1, sig_report);
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	switch (ingest_mode) {
+	case INGEST_CONNECT:
+		ingest_connect_loop(spec);
+		break;
+	case INGEST_LISTEN:
+		/* Only returns if the listening socket is unusable */
+		ingest_listen_loop(spec);
+		tty_close();
+		return 1;
+	case INGEST_REPLAY:
+		(void) ingest_replay(spec, rate);
+		break;
+	default:
+		break;
+	}
 	
 	while (pause())
 		;
@@ -27,6 +27,7 @@
 #include "lunix.h"
 #include "lunix-chrdev.h"
 #include "lunix-lookup.h"
+#include "lunix-format.h"
 
 /*
  * Global data
@@ -42,10 +43,26 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 	struct lunix_sensor_struct *sensor;
 	WARN_ON ( !(sensor = state->sensor));
 
-	if (state->buf_timestamp < sensor->msr_data[state->type]->last_update) return 1;
+	if (state->buf_seq != sensor->hist_seq) return 1;
 	else return 0;
 }
 
+/*
+ * Formats a single raw measurement of the given type
+ * as a line of text. Returns the number of bytes written.
+ */
+static int lunix_chrdev_format(enum lunix_msr_enum type, uint16_t raw, unsigned char *buf)
+{
+	long num;
+
+	if (type == BATT) num = lookup_voltage[raw];
+	else if (type == TEMP) num = lookup_temperature[raw];
+	else num = lookup_light[raw];
+
+	/* No sprintf(): see lunix-format.h, and lunix-fmtbench.c for numbers */
+	return lunix_format_milli(num, (char *)buf);
+}
+
 /*
  * Updates the cached state of a character device
  * based on sensor data. Must be called with the
@@ -54,9 +71,9 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 {
 	struct lunix_sensor_struct *sensor;
-	uint16_t temp;								//grab measurement without formatting in spinlock
-	long num, akeraio, dekadiko;
-	char sign;
+	uint16_t raw[LUNIX_CHRDEV_READAHEAD];		//grab measurements without formatting in spinlock
+	uint32_t seq;
+	int i, n;
 
 	WARN_ON ( !(sensor = state->sensor));
 
@@ -67,30 +84,24 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
 		return -EAGAIN;
 	}
 
+	/*
+	 * Copy out every sample since the last refresh. If we have
+	 * fallen more than a ring's worth behind, the oldest are lost.
+	 */
 	spin_lock(&sensor->lock);					/* Why use spinlocks? See LDD3, p. 119 */
-	state->buf_timestamp = sensor->msr_data[state->type]->last_update;
-	temp = sensor->msr_data[state->type]->values[0];
+	n = sensor->hist_seq - state->buf_seq;
+	if (n > LUNIX_CHRDEV_READAHEAD)
+		n = LUNIX_CHRDEV_READAHEAD;
+	seq = sensor->hist_seq - n;
+	for (i = 0; i < n; i++, seq++)
+		raw[i] = sensor->hist[seq % LUNIX_SENSOR_HISTORY][state->type];
+	state->buf_seq = seq;
 	spin_unlock(&sensor->lock);
 
-	if (state->type == BATT) num = lookup_voltage[temp];
-	else if (state->type == TEMP) num = lookup_temperature[temp];
-	else num = lookup_light[temp];
-
-	if (num == 0) {
-		state->buf_lim = sprintf(state->buf_data, "0\n");
-		debug("leaving\n");
-		return 0;
-	}
-	else if (num > 0) sign = '+';
-	else {
-		sign = '-';
-		num *= -1;
-	}
-
-	dekadiko = num % 1000;				// edo ta 3 psifia poy deixnoyn to float kommati
-	akeraio = num / 1000;				// edo ta 2 psifia poy deixnoyn to int kommati
-
-	state->buf_lim = sprintf(state->buf_data, "%c%ld.%ld\n", sign, akeraio, dekadiko);
+	state->buf_lim = 0;
+	for (i = 0; i < n; i++)
+		state->buf_lim += lunix_chrdev_format(state->type, raw[i],
+			state->buf_data + state->buf_lim);
 
 	debug("leaving\n");
 	return 0;
@@ -124,13 +135,16 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	state = (struct lunix_chrdev_state_struct *) kmalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
 	if (state == NULL) goto out;
 
-	state->buf_timestamp = 0;
+	/* The first read returns the latest sample, if there is one already */
+	state->sensor = &lunix_sensors[sensor_no];
+	spin_lock(&state->sensor->lock);
+	state->buf_seq = state->sensor->hist_seq ? state->sensor->hist_seq - 1 : 0;
+	spin_unlock(&state->sensor->lock);
 	if (type_no == 0) state->type = BATT;
 	else if (type_no == 1) state->type = TEMP;
 	else if (type_no == 2) state->type = LIGHT;
 	else goto out;
 	sema_init(&state->lock, 1);
-	state->sensor = &lunix_sensors[sensor_no];
 
 	filp->private_data = state;
 
@@ -162,6 +176,7 @@ static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned lon
 static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
 {
 	ssize_t ret;
+	int link_gen;
 
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
@@ -186,13 +201,23 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	 * on a "fresh" measurement, do so
 	 */
 	if (*f_pos == 0) {
+		link_gen = atomic_read(&lunix_link_gen);
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
 			/* The process needs to sleep */
 			/* See LDD3, page 153 for a hint */
 			up(&state->lock); /* release the lock */
-			if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state) == 1))
+			/*
+			 * The link is down, before the first attach or after a
+			 * detach: don't wait for data that will never come.
+			 */
+			if (!lunix_link_is_up(link_gen) && !lunix_chrdev_state_needs_refresh(state))
+				return -ENOLINK;
+			if (wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state) == 1 ||
+					atomic_read(&lunix_link_gen) != link_gen))
 				return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-			/* otherwise loop, but first reacquire the lock */
+			/* A detach is caught above, a reattach just restarts the wait */
+			link_gen = atomic_read(&lunix_link_gen);
+			/* Loop, but first reacquire the lock */
 			if (down_interruptible(&state->lock))
 				return -ERESTARTSYS;
 		}
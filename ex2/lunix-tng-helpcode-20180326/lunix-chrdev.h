@@ -15,6 +15,7 @@
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
 #define LUNIX_CHRDEV_BUFSZ      20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_READAHEAD  64      /* Max samples formatted per refresh */
 
 /* Compile-time parameters */
 
@@ -33,10 +34,14 @@ struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
 	struct lunix_sensor_struct *sensor;
 
-	/* A buffer used to hold cached textual info */
+	/*
+	 * A buffer used to hold cached textual info, one line per
+	 * sample received since the last refresh, and the sensor
+	 * sequence number up to which samples have been consumed
+	 */
 	int buf_lim;
-	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ * LUNIX_CHRDEV_READAHEAD];
+	uint32_t buf_seq;
 
 	struct semaphore lock;
 
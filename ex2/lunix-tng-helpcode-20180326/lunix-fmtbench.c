@@ -0,0 +1,101 @@
+/*
+ * lunix-fmtbench.c
+ *
+ * Userspace microbenchmark for the Lunix:TNG measurement formatting:
+ * runs every one of the 3 x 65536 lookup table outputs through the
+ * old sprintf() path and through lunix_format_milli(), checks the
+ * latter against a zero-padded sprintf() and reports ns/sample.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lunix-lookup.h"
+#include "lunix-format.h"
+
+#define BENCH_ROUNDS	20
+
+static long *tables[] = { lookup_voltage, lookup_temperature, lookup_light };
+static const char *table_names[] = { "batt", "temp", "light" };
+
+/* The formatting lunix_chrdev_state_update() used to do */
+static int format_sprintf(long num, char *buf)
+{
+	char sign;
+
+	if (num == 0)
+		return sprintf(buf, "0\n");
+	else if (num > 0) sign = '+';
+	else {
+		sign = '-';
+		num *= -1;
+	}
+
+	return sprintf(buf, "%c%ld.%ld\n", sign, num / 1000, num % 1000);
+}
+
+/* What it should have printed */
+static int format_reference(long num, char *buf)
+{
+	if (num == 0)
+		return sprintf(buf, "0\n");
+	return sprintf(buf, "%c%ld.%03ld\n", (num > 0) ? '+' : '-',
+		labs(num) / 1000, labs(num) % 1000);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time fmt over all tables, return ns per formatted sample. */
+static double bench(int (*fmt)(long, char *), unsigned long *sink)
+{
+	char buf[LUNIX_FORMAT_MAXLEN];
+	double t0;
+	int r, t, i;
+
+	t0 = now_ns();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (t = 0; t < 3; t++)
+			for (i = 0; i < 65536; i++)
+				*sink += fmt(tables[t][i], buf) + buf[1];
+
+	return (now_ns() - t0) / (BENCH_ROUNDS * 3 * 65536.0);
+}
+
+int main(void)
+{
+	char a[LUNIX_FORMAT_MAXLEN], b[LUNIX_FORMAT_MAXLEN];
+	unsigned long sink = 0, bad = 0, padded = 0;
+	double old_ns, new_ns;
+	int t, i, la, lb;
+
+	/* Correctness first, over every possible table output */
+	for (t = 0; t < 3; t++)
+		for (i = 0; i < 65536; i++) {
+			la = lunix_format_milli(tables[t][i], a);
+			lb = format_reference(tables[t][i], b);
+			if (la != lb || memcmp(a, b, la)) {
+				if (bad++ < 10)
+					fprintf(stderr, "%s[%d] = %ld: got \"%.*s\", want \"%.*s\"\n",
+						table_names[t], i, tables[t][i], la - 1, a, lb - 1, b);
+			}
+			if (format_sprintf(tables[t][i], a) != lb || memcmp(a, b, lb))
+				padded++;
+		}
+	printf("%lu mismatches, %lu values the old path printed wrongly\n", bad, padded);
+
+	old_ns = bench(format_sprintf, &sink);
+	new_ns = bench(lunix_format_milli, &sink);
+	printf("sprintf:            %6.2f ns/sample\n", old_ns);
+	printf("lunix_format_milli: %6.2f ns/sample (%.1fx)\n", new_ns, old_ns / new_ns);
+
+	return (bad || !sink) ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * lunix-format.h
+ *
+ * Fixed-point to decimal conversion of Lunix:TNG measurements,
+ * shared between the character device and the userspace benchmark.
+ *
+ * The lookup tables hold values in thousandths, so printing one is
+ * just a matter of splitting it in groups of three decimal digits,
+ * each of which is copied from a precomputed, zero-padded string.
+ *
+ */
+
+#ifndef _LUNIX_FORMAT_H
+#define _LUNIX_FORMAT_H
+
+#define LUNIX_FORMAT_MAXLEN	23	/* sign, 19 digits, '.', '\n', slack */
+
+/* "000" to "999", generated by mk_lookup_tables into lunix-lookup.h */
+extern const char lookup_digits[1000][4];
+
+/*
+ * Format num / 1000 as "[+-]<int>.<3 digits>\n", or "0\n" for zero,
+ * into buf, without a terminating NUL. Returns the number of bytes used.
+ */
+static inline int lunix_format_milli(long num, char *buf)
+{
+	unsigned long v, groups[8];
+	const char *d;
+	char *p = buf;
+	int n;
+
+	if (num == 0) {
+		*p++ = '0';
+		*p++ = '\n';
+		return p - buf;
+	}
+	if (num > 0) {
+		*p++ = '+';
+		v = num;
+	} else {
+		*p++ = '-';
+		v = -(unsigned long)num;
+	}
+
+	/* The fractional part, then the integer part, least significant first */
+	groups[0] = v % 1000;
+	v /= 1000;
+	n = 1;
+	do {
+		groups[n++] = v % 1000;
+		v /= 1000;
+	} while (v);
+
+	/* No leading zeros on the most significant group */
+	d = lookup_digits[groups[--n]];
+	if (groups[n] >= 100)
+		*p++ = d[0];
+	if (groups[n] >= 10)
+		*p++ = d[1];
+	*p++ = d[2];
+
+	while (--n > 0) {
+		d = lookup_digits[groups[n]];
+		p[0] = d[0];
+		p[1] = d[1];
+		p[2] = d[2];
+		p += 3;
+	}
+
+	d = lookup_digits[groups[0]];
+	p[0] = '.';
+	p[1] = d[0];
+	p[2] = d[1];
+	p[3] = d[2];
+	p[4] = '\n';
+	p += 5;
+
+	return p - buf;
+}
+
+#endif	/* _LUNIX_FORMAT_H */
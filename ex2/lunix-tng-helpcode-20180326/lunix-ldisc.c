@@ -42,6 +42,10 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 	tty->receive_room = 65536; /* No flow control, FIXME */
 
+	/* Don't glue the new stream onto a packet left over from the old one */
+	lunix_protocol_init(&lunix_protocol_state);
+	lunix_sensors_link_change();
+
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
 }
@@ -53,9 +57,12 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
+	/*
+	 * Wake up all sleepers in all sensors, they will find
+	 * the link down and return -ENOLINK to userspace.
+	 */
+	lunix_sensors_link_change();
 	atomic_inc(&lunix_disc_available);
-	/* FIXME */
-	/* Shouldn't we wake up all sleepers in all sensors here? */
 	debug("lunix ldisc being closed\n");
 }
 
@@ -15,6 +15,7 @@
 #include "lunix-chrdev.h"
 #include "lunix-ldisc.h"
 #include "lunix-protocol.h"
+#include "lunix-recorder.h"
 
 /*
  * Global state for Lunix:TNG sensors
@@ -22,6 +23,8 @@
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
 struct lunix_sensor_struct *lunix_sensors;
 struct lunix_protocol_state_struct lunix_protocol_state;
+atomic_t lunix_link_gen = ATOMIC_INIT(0);
+int lunix_record = 0;
 
 /*
  * Module init and cleanup functions
@@ -56,11 +59,18 @@ int __init lunix_module_init(void)
 		}
 	}
 
+	/*
+	 * Initialize the sample recorder, if asked to,
+	 * before any data can start flowing in
+	 */
+	if (lunix_record && (ret = lunix_recorder_init()) < 0)
+		goto out_with_sensors;
+
 	/*
 	 * Initialize the Lunix line discipline
 	 */
 	if ((ret = lunix_ldisc_init()) < 0)
-		goto out_with_sensors;
+		goto out_with_recorder;
 
 	/*
 	 * Initialize the Lunix character device
@@ -78,6 +88,11 @@ out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
 
+out_with_recorder:
+	debug("at out_with_recorder\n");
+	if (lunix_record)
+		lunix_recorder_destroy();
+
 out_with_sensors:
 	debug("at out_with_sensors\n");
 	for (; si_done >= 0; si_done--)
@@ -96,6 +111,8 @@ void __exit lunix_module_cleanup(void)
 	debug("entering, destroying chrdev and ldisc\n");
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
+	if (lunix_record)
+		lunix_recorder_destroy();
 	
 	debug("destroying sensor buffers\n");
 	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
@@ -115,6 +132,8 @@ MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
 MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+module_param(lunix_record, int, 0);
+MODULE_PARM_DESC(lunix_record, "Stream every sample to /dev/" LUNIX_REC_DEVNAME " for archiving");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
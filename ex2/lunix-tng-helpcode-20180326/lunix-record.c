@@ -0,0 +1,245 @@
+/*
+ * lunix-record.c
+ *
+ * Archiving daemon for the Lunix:TNG sample recorder.
+ *
+ * Drains /dev/lunix-rec [load the module with lunix_record=1]
+ * and appends the binary stream to a file, in large sequential
+ * writes. Can also decode a recording back to text.
+ *
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "lunix-recorder.h"
+
+#define REC_BUFSZ		(1 << 20)	/* Bytes collected per write */
+#define REC_FLUSH_SECS		5		/* Default max data age on disk */
+
+static volatile sig_atomic_t done = 0;
+
+static void sig_catch(int sig)
+{
+	done = 1;
+}
+
+/* Insist until all of the data has been written */
+static ssize_t insist_write(int fd, const void *buf, size_t cnt)
+{
+	ssize_t ret;
+	size_t orig_cnt = cnt;
+
+	while (cnt > 0) {
+		ret = write(fd, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		buf += ret;
+		cnt -= ret;
+	}
+
+	return orig_cnt;
+}
+
+static long long now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/* Drain the recorder into outfile until signalled. */
+static int record(const char *devpath, const char *outpath, int flush_secs)
+{
+	static unsigned char buf[REC_BUFSZ];
+	struct pollfd pfd;
+	long long deadline;
+	unsigned long long total = 0;
+	size_t fill = 0;
+	ssize_t n;
+	int dev, out, timeout;
+
+	if ((dev = open(devpath, O_RDONLY | O_NONBLOCK)) < 0) {
+		fprintf(stderr, "%s: %s\n", devpath, strerror(errno));
+		return 1;
+	}
+	if ((out = open(outpath, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "%s: %s\n", outpath, strerror(errno));
+		return 1;
+	}
+
+	pfd.fd = dev;
+	pfd.events = POLLIN;
+	deadline = now_ms() + flush_secs * 1000LL;
+	while (!done) {
+		timeout = fill ? (int)(deadline - now_ms()) : -1;
+		if (fill && timeout < 0)
+			timeout = 0;
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		n = read(dev, buf + fill, sizeof(buf) - fill);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			perror("read");
+			break;
+		}
+		if (n > 0) {
+			if (!fill)
+				deadline = now_ms() + flush_secs * 1000LL;
+			fill += n;
+		}
+
+		/* Write out full buffers, or data that has waited long enough */
+		if (fill == sizeof(buf) || (fill && now_ms() >= deadline)) {
+			if (insist_write(out, buf, fill) != fill) {
+				perror("write");
+				break;
+			}
+			total += fill;
+			fill = 0;
+		}
+	}
+
+	if (fill && insist_write(out, buf, fill) == fill)
+		total += fill;
+	fprintf(stderr, "lunix-record: %llu bytes recorded\n", total);
+	close(out);
+	close(dev);
+	return 0;
+}
+
+/* Read a varint, return the number of bytes used or 0 if truncated. */
+static int get_varint(const unsigned char *p, size_t len, uint64_t *v)
+{
+	int n;
+
+	*v = 0;
+	for (n = 0; n < len && n < LUNIX_REC_VARINT_MAX; n++) {
+		*v |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+		if (!(p[n] & 0x80))
+			return n + 1;
+	}
+	return 0;
+}
+
+/*
+ * Decode the record at p and print it, if it is a sample.
+ * Return its length, or 0 if fewer than len bytes hold it.
+ */
+static int decode_one(const unsigned char *p, size_t len, uint64_t *t, int *synced)
+{
+	uint64_t v;
+	int i, n;
+
+	if (p[0] == LUNIX_REC_SYNC) {
+		if (len < 9 || !(n = get_varint(p + 9, len - 9, &v)))
+			return 0;
+		for (*t = 0, i = 0; i < 8; i++)
+			*t |= (uint64_t)p[1 + i] << (8 * i);
+		if (v)
+			printf("# %" PRIu64 " records lost\n", v);
+		*synced = 1;
+		return 9 + n;
+	}
+
+	if (!(n = get_varint(p + 1, len - 1, &v)) || len < 1 + n + 6)
+		return 0;
+	*t += v;
+	p += 1 + n;
+	if (*synced)
+		printf("%" PRIu64 ".%06" PRIu64 " %u %u %u %u\n",
+			*t / 1000000, *t % 1000000, p[-1 - n],
+			p[0] | p[1] << 8, p[2] | p[3] << 8, p[4] | p[5] << 8);
+	return 1 + n + 6;
+}
+
+/* Print a recording as "usecs sensor batt temp light" lines of raw values. */
+static int decode(const char *inpath)
+{
+	static unsigned char buf[REC_BUFSZ];
+	uint64_t t = 0;
+	size_t fill = 0, pos;
+	ssize_t n;
+	int fd, len, synced = 0;
+
+	if ((fd = open(inpath, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", inpath, strerror(errno));
+		return 1;
+	}
+
+	while ((n = read(fd, buf + fill, sizeof(buf) - fill)) > 0) {
+		fill += n;
+		for (pos = 0; pos < fill; pos += len)
+			if (!(len = decode_one(buf + pos, fill - pos, &t, &synced)))
+				break;
+		memmove(buf, buf + pos, fill - pos);
+		fill -= pos;
+	}
+	if (n < 0)
+		perror("read");
+	if (fill)
+		fprintf(stderr, "%s: %zu trailing bytes of a truncated record\n", inpath, fill);
+
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-s flush_secs] [-D device] outfile\n"
+		"       %s -d infile\n"
+		"Append the sample stream of /dev/%s to outfile until interrupted,\n"
+		"or decode a recording to \"time sensor batt temp light\" lines.\n\n",
+		argv0, argv0, LUNIX_REC_DEVNAME);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, dflag = 0, flush_secs = REC_FLUSH_SECS;
+	const char *devpath = "/dev/" LUNIX_REC_DEVNAME;
+
+	while ((opt = getopt(argc, argv, "ds:D:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dflag = 1;
+			break;
+		case 's':
+			flush_secs = atoi(optarg);
+			break;
+		case 'D':
+			devpath = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	if (dflag)
+		return decode(argv[optind]);
+
+	(void) signal(SIGINT, sig_catch);
+	(void) signal(SIGTERM, sig_catch);
+	(void) signal(SIGHUP, sig_catch);
+
+	return record(devpath, argv[optind], flush_secs);
+}
@@ -0,0 +1,355 @@
+/*
+ * lunix-recorder.c
+ *
+ * Sample recorder for Lunix:TNG
+ *
+ * Every sensor update is encoded as a compact binary record
+ * [see lunix-recorder.h] and appended to a kernel ring buffer,
+ * which a single userspace daemon drains through /dev/lunix-rec
+ * with large sequential reads.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+
+#include <asm/atomic.h>
+#include <asm/uaccess.h>
+
+#include "lunix.h"
+#include "lunix-recorder.h"
+
+/*
+ * Recorder state. The ring holds whole records between tail and head;
+ * the writer only ever touches the free space after head and the single
+ * reader only the data before it, so the lock need not be held while
+ * copying to userspace. The reader may stop in the middle of a record,
+ * so tail only moves past the records it has had whole, and a reader
+ * opening the device after it resumes on a record boundary.
+ */
+static struct {
+	unsigned char *ring;
+	unsigned long head;		/* Next byte to write, mod RINGSZ */
+	unsigned long tail;		/* Next record to read, mod RINGSZ */
+	u64 last_us;			/* Monotonic time of the previous record */
+	unsigned long lost;		/* Records dropped since the last sync */
+	int need_sync;
+	spinlock_t lock;
+	wait_queue_head_t wq;
+
+	/* Reader side only */
+	unsigned long rpos;		/* Next byte to read, in or after the record at tail */
+	u64 tail_us;			/* Wall clock time of the record before tail */
+	unsigned char hdr[LUNIX_REC_MAXLEN];	/* Sync to start a new reader with */
+	int hdr_len, hdr_off;
+} rec;
+
+/* Only one daemon may drain the ring at any time */
+static atomic_t lunix_rec_available = ATOMIC_INIT(1);
+
+static inline unsigned long lunix_rec_used(void)
+{
+	return (rec.head - rec.tail) & (LUNIX_REC_RINGSZ - 1);
+}
+
+static inline unsigned char lunix_rec_byte(unsigned long pos)
+{
+	return rec.ring[pos & (LUNIX_REC_RINGSZ - 1)];
+}
+
+/* Encode v as a varint at p, return the number of bytes used */
+static int lunix_rec_varint(unsigned char *p, u64 v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* Append len bytes to the ring. Must be called with the lock held. */
+static int lunix_rec_put(const unsigned char *p, int len)
+{
+	unsigned long first;
+
+	/* Always leave one byte free, so that head == tail means empty */
+	if (LUNIX_REC_RINGSZ - 1 - lunix_rec_used() < len)
+		return -ENOSPC;
+
+	first = min_t(unsigned long, len, LUNIX_REC_RINGSZ - rec.head);
+	memcpy(rec.ring + rec.head, p, first);
+	memcpy(rec.ring, p + first, len - first);
+	rec.head = (rec.head + len) & (LUNIX_REC_RINGSZ - 1);
+	return 0;
+}
+
+/* Encode a sync record at r, return its length */
+static int lunix_rec_sync_encode(unsigned char *r, u64 wall, unsigned long lost)
+{
+	int i;
+
+	r[0] = LUNIX_REC_SYNC;
+	for (i = 0; i < 8; i++)
+		r[1 + i] = (wall >> (8 * i)) & 0xFF;
+	return 9 + lunix_rec_varint(r + 9, lost);
+}
+
+/*
+ * Emit a sync record, carrying the wall clock time. Must be called with
+ * the lock held; now is monotonic, like every delta after the sync, so
+ * that the wall clock being stepped can never make a delta negative.
+ */
+static int lunix_rec_sync(u64 now)
+{
+	unsigned char r[LUNIX_REC_MAXLEN];
+	int len;
+
+	len = lunix_rec_sync_encode(r, ktime_to_us(ktime_get_real()), rec.lost);
+	if (lunix_rec_put(r, len) < 0)
+		return -ENOSPC;
+
+	rec.need_sync = 0;
+	rec.lost = 0;
+	rec.last_us = now;
+	return 0;
+}
+
+/*
+ * Called by lunix_sensor_update() for every new set of measurements.
+ * If the daemon falls behind the record is dropped, and a sync record
+ * carrying the number of records lost is emitted once there is room.
+ */
+void lunix_recorder_add(int sensor, uint16_t batt, uint16_t temp, uint16_t light)
+{
+	unsigned char r[LUNIX_REC_MAXLEN];
+	int len;
+	u64 now;
+
+	if (!rec.ring || sensor > LUNIX_REC_MAX_SENSOR)
+		return;
+
+	now = ktime_to_us(ktime_get());
+
+	spin_lock(&rec.lock);
+	if (rec.need_sync && lunix_rec_sync(now) < 0)
+		goto lost;
+
+	r[0] = sensor;
+	len = 1 + lunix_rec_varint(r + 1, now - rec.last_us);
+	r[len++] = batt & 0xFF;
+	r[len++] = batt >> 8;
+	r[len++] = temp & 0xFF;
+	r[len++] = temp >> 8;
+	r[len++] = light & 0xFF;
+	r[len++] = light >> 8;
+	if (lunix_rec_put(r, len) < 0)
+		goto lost;
+	rec.last_us = now;
+	spin_unlock(&rec.lock);
+
+	wake_up_interruptible(&rec.wq);
+	return;
+
+lost:
+	rec.lost++;
+	rec.need_sync = 1;
+	spin_unlock(&rec.lock);
+}
+
+/*
+ * Move tail past the records between it and rpos that the reader has
+ * had whole, keeping tail_us the wall clock time of the last of them.
+ * Returns the new tail. Reader side only.
+ */
+static unsigned long lunix_rec_advance(unsigned long tail, unsigned long rpos)
+{
+	unsigned long avail, len;
+	unsigned char b;
+	u64 v;
+	int i, n, sync;
+
+	while ((avail = (rpos - tail) & (LUNIX_REC_RINGSZ - 1))) {
+		sync = lunix_rec_byte(tail) == LUNIX_REC_SYNC;
+		len = sync ? 9 : 1;
+		for (v = 0, n = 0; len + n < avail; n++) {
+			b = lunix_rec_byte(tail + len + n);
+			v |= (u64)(b & 0x7F) << (7 * n);
+			if (!(b & 0x80))
+				break;
+		}
+		if (len + n >= avail)
+			break;
+		len += n + 1 + (sync ? 0 : 6);
+		if (len > avail)
+			break;
+
+		if (sync)
+			for (rec.tail_us = 0, i = 0; i < 8; i++)
+				rec.tail_us |= (u64)lunix_rec_byte(tail + 1 + i) << (8 * i);
+		else
+			rec.tail_us += v;
+		tail = (tail + len) & (LUNIX_REC_RINGSZ - 1);
+	}
+	return tail;
+}
+
+/*************************************
+ * File operations for /dev/lunix-rec
+ *************************************/
+
+static int lunix_rec_open(struct inode *inode, struct file *filp)
+{
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!atomic_add_unless(&lunix_rec_available, -1, 0))
+		return -EBUSY;
+	if ((ret = nonseekable_open(inode, filp)) < 0) {
+		atomic_inc(&lunix_rec_available);
+		return ret;
+	}
+
+	/*
+	 * Resume on the first record a previous reader did not have whole,
+	 * keeping what was buffered while no daemon ran. The stream must
+	 * begin with a sync: the one at tail, a new one for the time of the
+	 * record before tail, or, if the ring is empty, the next one emitted.
+	 */
+	spin_lock(&rec.lock);
+	rec.rpos = rec.tail;
+	rec.hdr_off = rec.hdr_len = 0;
+	if (rec.tail == rec.head)
+		rec.need_sync = 1;
+	else if (lunix_rec_byte(rec.tail) != LUNIX_REC_SYNC)
+		rec.hdr_len = lunix_rec_sync_encode(rec.hdr, rec.tail_us, 0);
+	spin_unlock(&rec.lock);
+
+	debug("recorder opened\n");
+	return 0;
+}
+
+static int lunix_rec_release(struct inode *inode, struct file *filp)
+{
+	atomic_inc(&lunix_rec_available);
+	debug("recorder released\n");
+	return 0;
+}
+
+static ssize_t lunix_rec_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+{
+	unsigned long head, rpos, tail, avail, first;
+
+	/* The sync a resumed stream begins with goes first */
+	if (rec.hdr_off < rec.hdr_len) {
+		cnt = min_t(size_t, cnt, rec.hdr_len - rec.hdr_off);
+		if (copy_to_user(usrbuf, rec.hdr + rec.hdr_off, cnt))
+			return -EFAULT;
+		rec.hdr_off += cnt;
+		return cnt;
+	}
+
+	rpos = rec.rpos;
+	for (;;) {
+		spin_lock(&rec.lock);
+		head = rec.head;
+		spin_unlock(&rec.lock);
+		if (head != rpos)
+			break;
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(rec.wq, rec.head != rpos))
+			return -ERESTARTSYS;
+	}
+
+	avail = (head - rpos) & (LUNIX_REC_RINGSZ - 1);
+	if (cnt > avail)
+		cnt = avail;
+
+	first = min_t(unsigned long, cnt, LUNIX_REC_RINGSZ - rpos);
+	if (copy_to_user(usrbuf, rec.ring + rpos, first) ||
+	    copy_to_user(usrbuf + first, rec.ring, cnt - first))
+		return -EFAULT;
+
+	/* Only the records read whole are given back to the writer */
+	rec.rpos = (rpos + cnt) & (LUNIX_REC_RINGSZ - 1);
+	tail = lunix_rec_advance(rec.tail, rec.rpos);
+	spin_lock(&rec.lock);
+	rec.tail = tail;
+	spin_unlock(&rec.lock);
+
+	return cnt;
+}
+
+static unsigned int lunix_rec_poll(struct file *filp, poll_table *wait)
+{
+	poll_wait(filp, &rec.wq, wait);
+	return (rec.hdr_off < rec.hdr_len || rec.head != rec.rpos) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+static struct file_operations lunix_rec_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = lunix_rec_open,
+	.release        = lunix_rec_release,
+	.read           = lunix_rec_read,
+	.poll           = lunix_rec_poll,
+	.llseek         = no_llseek
+};
+
+static struct miscdevice lunix_rec_miscdev = {
+	.minor          = MISC_DYNAMIC_MINOR,
+	.name           = LUNIX_REC_DEVNAME,
+	.fops           = &lunix_rec_fops
+};
+
+int lunix_recorder_init(void)
+{
+	int ret;
+
+	debug("initializing recorder, %d byte ring\n", LUNIX_REC_RINGSZ);
+	spin_lock_init(&rec.lock);
+	init_waitqueue_head(&rec.wq);
+	rec.head = rec.tail = rec.rpos = 0;
+	rec.tail_us = 0;
+	rec.lost = 0;
+	rec.need_sync = 1;
+
+	ret = -ENOMEM;
+	if (!(rec.ring = vmalloc(LUNIX_REC_RINGSZ)))
+		goto out;
+
+	if ((ret = misc_register(&lunix_rec_miscdev)) < 0) {
+		debug("failed to register misc device, ret = %d\n", ret);
+		goto out_with_ring;
+	}
+	debug("completed successfully\n");
+	return 0;
+
+out_with_ring:
+	vfree(rec.ring);
+	rec.ring = NULL;
+out:
+	return ret;
+}
+
+void lunix_recorder_destroy(void)
+{
+	debug("entering\n");
+	misc_deregister(&lunix_rec_miscdev);
+	vfree(rec.ring);
+	rec.ring = NULL;
+	debug("leaving\n");
+}
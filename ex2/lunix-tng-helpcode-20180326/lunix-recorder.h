@@ -0,0 +1,55 @@
+/*
+ * lunix-recorder.h
+ *
+ * Definition file for the Lunix:TNG sample recorder,
+ * which streams every sensor update in a compact binary
+ * format to a userspace daemon for archiving.
+ *
+ */
+
+#ifndef _LUNIX_RECORDER_H
+#define _LUNIX_RECORDER_H
+
+/*
+ * Record format
+ *
+ * The stream is a sequence of variable-length records. The first byte
+ * tells them apart:
+ *
+ * BYTE			MEANING
+ * 0xFF			Sync record, starts every stream and follows any loss
+ *   1-8		  Absolute time, usecs since the epoch, little-endian
+ *   9-			  Records lost since the previous sync, varint
+ * 0x00-0xFE		Sample record, the byte is the sensor index
+ *   1-			  Usecs since the previous record, varint
+ *   next 6		  Raw battery, temperature, light, little-endian
+ *
+ * Deltas are measured on the monotonic clock and only the sync record
+ * carries wall clock time, so a sample's time is that of the last sync
+ * plus the deltas since; stepping the wall clock moves the next sync.
+ *
+ * A varint is the usual LEB128 encoding: 7 bits per byte,
+ * least significant group first, high bit set on all but the last byte.
+ * A sample record from a busy network is typically 9 or 10 bytes long.
+ */
+#define LUNIX_REC_SYNC			0xFF
+#define LUNIX_REC_MAX_SENSOR		0xFE
+#define LUNIX_REC_VARINT_MAX		10
+#define LUNIX_REC_MAXLEN		(1 + 8 + LUNIX_REC_VARINT_MAX)
+
+#define LUNIX_REC_DEVNAME		"lunix-rec"
+
+#ifdef __KERNEL__
+
+#define LUNIX_REC_RINGSZ		(1 << 20)	/* Bytes buffered in the kernel */
+
+/*
+ * Function prototypes
+ */
+int lunix_recorder_init(void);
+void lunix_recorder_destroy(void);
+void lunix_recorder_add(int sensor, uint16_t batt, uint16_t temp, uint16_t light);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* _LUNIX_RECORDER_H */
@@ -24,6 +24,7 @@
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-recorder.h"
 
 /*
  * Initialization and destruction of sensor structures
@@ -39,6 +40,7 @@ int lunix_sensor_init(struct lunix_sensor_struct *s)
 	 */
 	spin_lock_init(&s->lock);
 	init_waitqueue_head(&s->wq);
+	s->hist_seq = 0;
 
 	/*
 	 * Allocate one page per measurement buffer
@@ -74,6 +76,8 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	uint16_t *h;
+
 	spin_lock(&s->lock);
 	
 	/*
@@ -85,12 +89,39 @@ void lunix_sensor_update(struct lunix_sensor_struct *s,
 
 	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
 	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+
+	h = s->hist[s->hist_seq % LUNIX_SENSOR_HISTORY];
+	h[BATT] = batt;
+	h[TEMP] = temp;
+	h[LIGHT] = light;
+	s->hist_seq++;
 	
 	spin_unlock(&s->lock);
 
+	if (lunix_record)
+		lunix_recorder_add(s - lunix_sensors, batt, temp, light);
+
 	/*
 	 * And wake up any sleepers who may be waiting on
 	 * fresh data from this sensor.
 	 */
 	wake_up_interruptible(&s->wq);
 }
+
+/*
+ * The line discipline has been attached to or detached from a TTY.
+ * Move to the next link generation and wake up every sleeper
+ * on every sensor, so they can find out.
+ */
+void lunix_sensors_link_change(void)
+{
+	int i;
+
+	atomic_inc(&lunix_link_gen);
+	debug("link is now %s, generation %d\n",
+		lunix_link_is_up(atomic_read(&lunix_link_gen)) ? "up" : "down",
+		atomic_read(&lunix_link_gen));
+
+	for (i = 0; i < lunix_sensor_cnt; i++)
+		wake_up_interruptible_all(&lunix_sensors[i].wq);
+}
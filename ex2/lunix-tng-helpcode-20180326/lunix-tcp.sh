@@ -8,6 +8,9 @@ Usage: $0 pts_port
 
 Connect to the TCP endpoint $TCP_ENDPOINT
 and forward all incoming data to pts_port.
+
+'lunix-attach -c $TCP_ENDPOINT' does the same in a single
+process, without socat and without a separate pts pair.
 EOF
 	exit 1
 fi
@@ -17,6 +17,7 @@
 
 #include <linux/fs.h>
 #include <linux/tty.h>
+#include <linux/atomic.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
@@ -26,6 +27,7 @@
  */
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
+#define LUNIX_SENSOR_HISTORY	64	/* Samples kept per sensor, power of 2 */
 
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
 struct lunix_sensor_struct {
@@ -46,6 +48,14 @@ struct lunix_sensor_struct {
 	 * when this sensor has been updated with new data
 	 */
 	wait_queue_head_t wq;
+
+	/*
+	 * The most recent raw samples, in a ring indexed by the
+	 * total number of updates so far, so that readers can pick
+	 * up every sample they have missed since their last read.
+	 */
+	uint32_t hist_seq;
+	uint16_t hist[LUNIX_SENSOR_HISTORY][N_LUNIX_MSR];
 };
 
 /*
@@ -56,6 +66,20 @@ extern int lunix_sensor_cnt;
 extern struct lunix_sensor_struct *lunix_sensors;
 extern struct lunix_protocol_state_struct lunix_protocol_state;
 
+/*
+ * Link state generation, bumped every time the line discipline
+ * is attached to or detached from a TTY: odd means attached.
+ * Sleeping readers compare it against the value they went to
+ * sleep with, to notice the data source going away.
+ */
+extern atomic_t lunix_link_gen;
+#define lunix_link_is_up(gen)		((gen) & 1)
+
+/*
+ * Non-zero if every update is also fed to the sample recorder
+ */
+extern int lunix_record;
+
 /*
  * Debugging
  */
@@ -73,6 +97,7 @@ int lunix_sensor_init(struct lunix_sensor_struct *);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void lunix_sensors_link_change(void);
 
 #else
 #include <inttypes.h>
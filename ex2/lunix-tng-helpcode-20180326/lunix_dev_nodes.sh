@@ -10,3 +10,6 @@ for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# /dev/lunix-rec [lunix_record=1] is a misc device with a dynamic minor,
+# udev or devtmpfs creates it when the module is loaded.
@@ -3,7 +3,8 @@
  *
  * Computes the temperature and battery
  * lookup tables for converting 16-bit raw measurements
- * from the wireless sensors to actual floating point values.
+ * from the wireless sensors to actual floating point values,
+ * and the digit table used to print them [lunix-format.h].
  *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
@@ -119,6 +120,19 @@ int main(void)
 		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
 	}
 
+	fprintf(stdout, "};\n\n"
+		"const char lookup_digits[1000][4] = {\n");
+
+	/*
+	 * Zero-padded decimal digits for every group of three
+	 */
+	for (i = 0; i < 1000; i += 8) {
+		fprintf(stdout, "\t\"%03u\", \"%03u\", \"%03u\", \"%03u\", "
+			"\"%03u\", \"%03u\", \"%03u\", \"%03u\"",
+			i, i+1, i+2, i+3, i+4, i+5, i+6, i+7);
+		fprintf(stdout, (i != 992) ? ",\n" : "\n");
+	}
+
 	fprintf(stdout, "};\n\n");
 
 	return 0;
@@ -0,0 +1,469 @@
+/*
+ * socket-bench.c
+ * Simple TCP/IP communication using sockets
+ *
+ * Load generator and benchmark for the chat server: connects a number
+ * of clients, has some of them send timestamped messages and measures
+ * how fast, and how late, the server passes them on.
+ *
+ * By default every message goes to all other clients, and the time
+ * until the last of them has it is the fan-out latency. With -e the
+ * clients are paired off instead, each pair in a room of its own, and
+ * one of the pair echoes back whatever the other sends: that gives the
+ * round trip through the server.
+ *
+ * Each sender keeps at most a window of messages in flight, that is
+ * not yet received by every other client, so the latency measured is
+ * the server's and not that of an ever growing queue. With -r the
+ * senders send at a fixed total rate instead, whether the server keeps
+ * up or not, and latency counts from when each message was due, so a
+ * server that falls behind cannot hide it by slowing the senders down.
+ *
+ * With -z, some more clients connect and never read anything, to see
+ * how much a stalled client costs everybody else.
+ *
+ * The server is given as hostname and port, or in the address syntax
+ * of socket-common.h, unix:PATH for instance.
+ *
+ * Vasilakis Emmanouil, Giannou Aggeliki
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket-common.h"
+
+#define MAX_EVENTS	256
+#define BENCH_BUFSZ	CHAT_BUFSZ	/* A whole seqpacket record fits */
+#define MAX_SAMPLES	(4 << 20)	/* Delivery latencies kept */
+#define MIN_TICK	50000		/* Shortest pacing timer period, ns */
+
+struct bench_client {
+	int fd;
+	int sender;			/* Index among the senders, or -1 */
+	unsigned long next;		/* Next message of a sender */
+	unsigned long inflight;
+	char in[BENCH_BUFSZ];
+	size_t in_len;
+};
+
+static struct bench_client *bc;
+static int nclients = 100, nsenders = 1, msgsize = 64, nstalled, echo;
+static unsigned long nmessages = 1000, window = 16;
+static double rate;				/* Messages/s over all senders */
+static unsigned long long start;
+
+static struct chat_addr addr;		/* The server's */
+
+/* Per message: send time and receivers still to get it */
+static unsigned long long *sent_ns;
+static int *pending;
+
+static unsigned long long *delivery, *completion;	/* ns */
+static unsigned long ndelivery, ncompletion, nreceived;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(unsigned long long *v, unsigned long n, double p)
+{
+	unsigned long i = n * p;
+
+	if (!n)
+		return 0;
+	return v[i < n ? i : n - 1] / 1000.0;
+}
+
+/* The client that sends as sender i */
+static struct bench_client *sender(unsigned long i)
+{
+	return &bc[echo ? 2 * i : i];
+}
+
+/*
+ * Send the next messages of sender c, as far as the window, and with -r
+ * the clock, allows, all of the frames that fit in the buffer with one
+ * write().
+ */
+static void send_more(struct bench_client *c)
+{
+	char buf[BENCH_BUFSZ], *p;
+	unsigned long long t = 0, now = now_ns();
+	unsigned long seq;
+	size_t len;
+	int n;
+
+	while (c->next < nmessages && c->inflight < window) {
+		for (len = 0; c->next < nmessages && c->inflight < window &&
+		     len + FRAME_HDRLEN + msgsize <= sizeof(buf); len += FRAME_HDRLEN + msgsize) {
+			/* Senders take turns, 1/rate seconds apart */
+			if (rate) {
+				t = start + (c->next * nsenders + c->sender) * 1e9 / rate;
+				if (t > now)
+					break;
+			}
+			seq = c->sender * nmessages + c->next;
+			sent_ns[seq] = rate ? t : now_ns();
+			pending[seq] = echo ? 1 : nclients - 1;
+
+			/* "<seq> <ns> ", padded up to msgsize */
+			p = buf + len + FRAME_HDRLEN;
+			frame_header((unsigned char *)buf + len, msgsize);
+			n = snprintf(p, msgsize, "%lu %llu ", seq, sent_ns[seq]);
+			memset(p + n, 'x', msgsize - n);
+			c->next++;
+			c->inflight++;
+		}
+		if (!len)
+			break;
+		if (insist_write(c->fd, buf, len) != len) {
+			perror("write to server failed");
+			exit(1);
+		}
+	}
+}
+
+static void received(struct bench_client *c, const char *msg, size_t cnt,
+	unsigned long long now)
+{
+	unsigned long seq;
+	unsigned long long t;
+	struct bench_client *s;
+	char *end;
+
+	seq = strtoul(msg, &end, 10);
+	t = strtoull(end, NULL, 10);
+	if (seq >= nsenders * nmessages || sent_ns[seq] != t) {
+		fprintf(stderr, "Garbled message \"%.*s\"\n", (int)(cnt < 20 ? cnt : 20), msg);
+		exit(1);
+	}
+
+	nreceived++;
+	s = sender(seq / nmessages);
+	if (c != s) {
+		if (ndelivery < MAX_SAMPLES)
+			delivery[ndelivery++] = now - t;
+		/* Straight back to the other one of the pair */
+		if (echo) {
+			if (frame_write(c->fd, msg, cnt) != FRAME_HDRLEN + cnt) {
+				perror("write to server failed");
+				exit(1);
+			}
+			return;
+		}
+	}
+	if (--pending[seq] == 0) {
+		completion[ncompletion++] = now - t;
+		s->inflight--;
+		send_more(s);
+	}
+}
+
+static int client_read(struct bench_client *c)
+{
+	struct iovec iov[CHAT_IOVS];
+	unsigned long long now;
+	ssize_t n, used;
+	size_t pos;
+	int i, cnt;
+
+	/* Only reads are non-blocking: a sender is held back by the server */
+	for (;;) {
+		n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		c->in_len += n;
+
+		now = now_ns();
+		pos = 0;
+		do {
+			cnt = CHAT_IOVS;
+			if ((used = frame_parse(c->in + pos, c->in_len - pos, iov, &cnt)) < 0)
+				return -1;
+			for (i = 0; i < cnt; i++)
+				received(c, iov[i].iov_base, iov[i].iov_len, now);
+			pos += used;
+		} while (cnt == CHAT_IOVS);
+		c->in_len -= pos;
+		memmove(c->in, c->in + pos, c->in_len);
+	}
+}
+
+/* A connected socket, with a receive buffer of rcvbuf bytes unless 0 */
+static int bench_connect(int rcvbuf)
+{
+	int sd, one = 1;
+
+	if ((sd = socket(addr.sa.ss_family, addr.type, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (rcvbuf)
+		setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (connect(sd, (struct sockaddr *)&addr.sa, addr.len) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	if (addr.sa.ss_family == AF_INET)
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sd;
+}
+
+/* Whether every sender has sent all of its messages */
+static int senders_done(void)
+{
+	int i;
+
+	for (i = 0; i < nsenders; i++)
+		if (sender(i)->next < nmessages)
+			return 0;
+	return 1;
+}
+
+/* Every tick of the pacing timer, the senders send what has fallen due. */
+static int bench_timer(void)
+{
+	struct itimerspec its;
+	long long tick = 1e9 / rate;
+	int tfd;
+
+	if (tick < MIN_TICK)
+		tick = MIN_TICK;
+	its.it_interval.tv_sec = its.it_value.tv_sec = tick / 1000000000;
+	its.it_interval.tv_nsec = its.it_value.tv_nsec = tick % 1000000000;
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+	    timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		perror("timerfd");
+		exit(1);
+	}
+	return tfd;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-e] [-c clients] [-s senders] [-m messages] [-w window] [-r rate]\n"
+		"          [-l bytes] [-z stalled] [hostname [port] | address]\n"
+		"Every sender sends the messages, of the given length, to all other clients,\n"
+		"or with -e to the other one of its pair, which echoes them back.\n"
+		"With -r they send that many messages a second between them.\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	unsigned long long elapsed, ticks;
+	unsigned long total, sent, lost, seq;
+	const char *hostname = "localhost";
+	int epfd, tfd = -1, i, j, n, opt, port = TCP_PORT, windowed = 0;
+	char join[32];
+
+	while ((opt = getopt(argc, argv, "ec:s:m:w:r:l:z:")) != -1) {
+		switch (opt) {
+		case 'e':
+			echo = 1;
+			break;
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 's':
+			nsenders = atoi(optarg);
+			break;
+		case 'm':
+			nmessages = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 10);
+			windowed = 1;
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'l':
+			msgsize = atoi(optarg);
+			break;
+		case 'z':
+			nstalled = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		hostname = argv[optind++];
+	if (optind < argc)
+		port = atoi(argv[optind++]);
+	/* Half of the clients send, the other half echo */
+	if (echo)
+		nsenders = nclients / 2;
+	/* At a fixed rate, nothing holds the senders back unless asked */
+	if (rate && !windowed)
+		window = ULONG_MAX;
+	if (optind < argc || nclients < 2 || nsenders < 1 || nsenders > nclients ||
+	    (echo && nclients % 2) || window < 1 || rate < 0 ||
+	    msgsize < 32 || msgsize > BENCH_BUFSZ - FRAME_HDRLEN)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (chat_address(hostname, port, &addr) < 0)
+		exit(1);
+
+	total = nsenders * nmessages;
+	bc = calloc(nclients, sizeof(*bc));
+	sent_ns = calloc(total, sizeof(*sent_ns));
+	pending = calloc(total, sizeof(*pending));
+	completion = calloc(total, sizeof(*completion));
+	delivery = malloc(MAX_SAMPLES * sizeof(*delivery));
+	if (!bc || !sent_ns || !pending || !completion || !delivery) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	fprintf(stderr, "Connecting %d clients to %s... ", nclients, hostname);
+	for (i = 0; i < nclients; i++) {
+		bc[i].fd = bench_connect(0);
+		if (echo)
+			bc[i].sender = i % 2 ? -1 : i / 2;
+		else
+			bc[i].sender = i < nsenders ? i : -1;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &bc[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, bc[i].fd, &ev) < 0) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+		/* Every pair in a room of its own */
+		n = snprintf(join, sizeof(join), "/join bench%d", i / 2);
+		if (echo && frame_write(bc[i].fd, join, n) != FRAME_HDRLEN + n) {
+			perror("write to server failed");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nstalled; i++)
+		bench_connect(4096);
+	/* Give the server time to take everybody in before the first message */
+	usleep(200000 + nclients * 100);
+	fprintf(stderr, "done.\n");
+
+	if (rate) {
+		tfd = bench_timer();
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	start = now_ns();
+	for (i = 0; i < nsenders; i++)
+		send_more(sender(i));
+
+	while (ncompletion < total) {
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, 5000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		if (n == 0) {
+			fprintf(stderr, "Timed out, %lu of %lu messages done\n",
+				ncompletion, total);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (!events[i].data.ptr) {
+				if (read(tfd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+					perror("read from timerfd");
+				for (j = 0; j < nsenders; j++)
+					send_more(sender(j));
+				/* Or it would keep epoll_wait() from ever timing out */
+				if (senders_done()) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, tfd, NULL);
+					close(tfd);
+				}
+				continue;
+			}
+			if (client_read(events[i].data.ptr) < 0) {
+				fprintf(stderr, "Server went away\n");
+				exit(1);
+			}
+		}
+	}
+	elapsed = now_ns() - start;
+
+	/* Messages sent that some client never got, dropped by the server, say */
+	for (sent = 0, i = 0; i < nsenders; i++)
+		sent += sender(i)->next;
+	for (lost = 0, seq = 0; seq < total; seq++)
+		if (pending[seq] && seq % nmessages < sender(seq / nmessages)->next)
+			lost++;
+
+	qsort(delivery, ndelivery, sizeof(*delivery), cmp_ull);
+	qsort(completion, ncompletion, sizeof(*completion), cmp_ull);
+	printf("%d clients, %d senders, %lu messages of %d bytes each, ",
+		nclients, nsenders, nmessages, msgsize);
+	if (rate)
+		printf("%.0f msgs/s target\n", rate);
+	else
+		printf("window %lu\n", window);
+	printf("%.3f s: %.0f msgs/s in, %.0f msgs/s out\n", elapsed / 1e9,
+		ncompletion / (elapsed / 1e9), nreceived / (elapsed / 1e9));
+	if (lost)
+		printf("%lu of %lu messages sent were lost on the way%s\n", lost, sent,
+			echo ? "" : " to some client");
+	printf("delivery latency   p50 %8.1f  p99 %8.1f  p99.9 %8.1f us\n",
+		percentile(delivery, ndelivery, 0.5), percentile(delivery, ndelivery, 0.99),
+		percentile(delivery, ndelivery, 0.999));
+	printf("%-18s p50 %8.1f  p99 %8.1f  p99.9 %8.1f us\n",
+		echo ? "round trip" : "fan-out completion",
+		percentile(completion, ncompletion, 0.5), percentile(completion, ncompletion, 0.99),
+		percentile(completion, ncompletion, 0.999));
+
+	return ncompletion < total;
+}
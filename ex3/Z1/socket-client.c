@@ -17,48 +17,36 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "socket-common.h"
 
 int main(int argc, char *argv[])
 {
-	int sd, port;
-	char *hostname;
-	struct hostent *hp;
-	struct sockaddr_in sa;
+	struct chat_addr addr;
+	int sd;
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s hostname port\n", argv[0]);
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s [address | hostname port]\n"
+			"address is [host][:port], unix:PATH or unix-seqpacket:PATH\n",
+			argv[0]);
 		exit(1);
 	}
-	hostname = argv[1];
-	port = atoi(argv[2]); /* Needs better error checking */
 
-	/* Create TCP/IP socket, used as main chat channel */
-	if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
+	/* Look up the remote host, or the path of a local socket */
+	if (argc == 3 ? chat_address(argv[1], atoi(argv[2]), &addr) :
+	    chat_address(argv[1], TCP_PORT, &addr))
 		exit(1);
-	}
-	fprintf(stderr, "Created TCP socket\n");
 
-	/* Look up remote hostname on DNS */
-	if ( !(hp = gethostbyname(hostname))) {
-		printf("DNS lookup failed for host %s\n", hostname);
+	/* Connect to it, over TCP/IP or a UNIX domain socket */
+	fprintf(stderr, "Connecting to %s... ", argv[1]); fflush(stderr);
+	if ((sd = chat_connect(&addr)) < 0)
 		exit(1);
-	}
-
-	/* Connect to remote TCP port */
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(port);
-	memcpy(&sa.sin_addr.s_addr, hp->h_addr, sizeof(struct in_addr));
-	fprintf(stderr, "Connecting to remote host... "); fflush(stderr);
-	if (connect(sd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
-		perror("connect");
-		exit(1);
-	}
 	fprintf(stderr, "Connected.\n");
 
 	chat(sd);
@@ -11,8 +11,30 @@
 
 /* Compile-time options */
 #define TCP_PORT    35001
-#define TCP_BACKLOG 5
+#define TCP_BACKLOG 1024
 
+/*
+ * Every message travels as a frame: the length of its payload in 4
+ * bytes, in network byte order, followed by the payload itself.
+ */
+#define FRAME_HDRLEN	4
+#define FRAME_MAXLEN	65536			/* Longest payload accepted */
+#define CHAT_BUFSZ	(FRAME_HDRLEN + FRAME_MAXLEN)
+#define CHAT_IOVS	64			/* Frames per writev() */
+
+/*
+ * Where to listen or connect to, in one of:
+ *	[HOST][:PORT]		TCP/IPv4, any address and the default port if left out
+ *	unix:PATH		UNIX domain stream socket
+ *	unix-seqpacket:PATH	UNIX domain seqpacket socket
+ * A seqpacket record holds whole frames, CHAT_BUFSZ bytes of them at most,
+ * so a reader with that much room never gets a frame in pieces.
+ */
+struct chat_addr {
+	int type;				/* SOCK_STREAM or SOCK_SEQPACKET */
+	socklen_t len;
+	struct sockaddr_storage sa;
+};
 
 #endif /* _SOCKET_COMMON_H */
 
@@ -33,12 +55,95 @@ ssize_t insist_write(int fd, const void *buf, size_t cnt)
 	return orig_cnt;
 }
 
+/* Insist until all of the iovecs have been written, using them up */
+ssize_t insist_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret, total = 0;
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		total += ret;
+		for (; iovcnt > 0 && ret >= iov->iov_len; iov++, iovcnt--)
+			ret -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+void frame_header(unsigned char *hdr, uint32_t len)
+{
+	hdr[0] = len >> 24;
+	hdr[1] = len >> 16;
+	hdr[2] = len >> 8;
+	hdr[3] = len;
+}
+
+uint32_t frame_length(const void *hdr)
+{
+	const unsigned char *p = hdr;
+
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Send buf as one frame, header and payload in a single writev() */
+ssize_t frame_write(int fd, const void *buf, size_t cnt)
+{
+	unsigned char hdr[FRAME_HDRLEN];
+	struct iovec iov[2];
+
+	frame_header(hdr, cnt);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = cnt;
+	return insist_writev(fd, iov, 2);
+}
+
+/*
+ * Find the complete frames at the start of buf, at most *iovcnt of them,
+ * and point an iovec at the payload of each, where it lies. Sets *iovcnt
+ * to the number found and returns the bytes they take up, or -1 if a
+ * frame is longer than FRAME_MAXLEN.
+ */
+ssize_t frame_parse(const char *buf, size_t len, struct iovec *iov, int *iovcnt)
+{
+	size_t pos = 0;
+	uint32_t n;
+	int i;
+
+	for (i = 0; i < *iovcnt && len - pos >= FRAME_HDRLEN; i++) {
+		n = frame_length(buf + pos);
+		if (n > FRAME_MAXLEN)
+			return -1;
+		if (len - pos - FRAME_HDRLEN < n)
+			break;
+		iov[i].iov_base = (char *)buf + pos + FRAME_HDRLEN;
+		iov[i].iov_len = n;
+		pos += FRAME_HDRLEN + n;
+	}
+	*iovcnt = i;
+
+	return pos;
+}
+
 /* Chat implementation, shared code between client and server */
 void chat(int socket_fd)
 {
-	char buf[100];
+	char in[CHAT_BUFSZ], buf[FRAME_MAXLEN];
+	struct iovec iov[CHAT_IOVS];
+	size_t in_len = 0;
 	fd_set readfds;
-	ssize_t n;
+	ssize_t n, used;
+	int cnt;
 
 	for(;;) {
 		FD_ZERO(&readfds);
@@ -50,7 +155,7 @@ void chat(int socket_fd)
 		}
 		if (FD_ISSET(socket_fd, &readfds)) {
 			/* Read from peer and write it to standard output */
-			n = read(socket_fd, buf, sizeof(buf));
+			n = read(socket_fd, in + in_len, sizeof(in) - in_len);
 
 			if (n < 0) {
 				perror("read from socket failed\n");
@@ -60,15 +165,26 @@ void chat(int socket_fd)
 				fprintf(stderr, "Peer went away\n");
 				return;
 			}
+			in_len += n;
 
-			if (insist_write(1, buf, n) != n) {
-				perror("write to stdout failed\n");
-				exit(1);
-			}
+			/* Every complete frame in one writev(), straight from in[] */
+			do {
+				cnt = CHAT_IOVS;
+				if ((used = frame_parse(in, in_len, iov, &cnt)) < 0) {
+					fprintf(stderr, "Bad frame from peer\n");
+					exit(1);
+				}
+				if (cnt && insist_writev(1, iov, cnt) < 0) {
+					perror("write to stdout failed\n");
+					exit(1);
+				}
+				in_len -= used;
+				memmove(in, in + used, in_len);
+			} while (cnt == CHAT_IOVS);
 		}
 		if (FD_ISSET(0, &readfds)) {
-			/* Read from stdin and write it to socket */
-			n = read(0, buf, sizeof(buf)-1);
+			/* Read from stdin and send it to the socket as one frame */
+			n = read(0, buf, sizeof(buf));
 
 			if (n < 0) {
 				perror("read from stdin failed\n");
@@ -79,11 +195,85 @@ void chat(int socket_fd)
 				exit(1);
 			}
 
-			buf[n] = '\0';			/* last character \0 */
-			if (insist_write(socket_fd, buf, n+1) != n+1) {
+			if (frame_write(socket_fd, buf, n) != FRAME_HDRLEN + n) {
 				perror("write to remote peer failed\n");
 				exit(1);
 			}
 		}
 	}
 }
+
+/* Fill in a from spec, port being the default; returns -1 if it is no good */
+int chat_address(const char *spec, int port, struct chat_addr *a)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&a->sa;
+	struct sockaddr_un *sun = (struct sockaddr_un *)&a->sa;
+	char host[256];
+	const char *colon, *path = NULL;
+	struct hostent *hp;
+
+	memset(a, 0, sizeof(*a));
+	a->type = SOCK_STREAM;
+	if (!strncmp(spec, "unix:", 5)) {
+		path = spec + 5;
+	} else if (!strncmp(spec, "unix-seqpacket:", 15)) {
+		path = spec + 15;
+		a->type = SOCK_SEQPACKET;
+	}
+	if (path) {
+		if (!*path || strlen(path) >= sizeof(sun->sun_path)) {
+			fprintf(stderr, "Bad socket path: %s\n", path);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, path);
+		a->len = sizeof(*sun);
+		return 0;
+	}
+
+	/* A lone number is a port */
+	if (*spec && strspn(spec, "0123456789") == strlen(spec)) {
+		port = atoi(spec);
+		spec = "";
+	}
+	if ((colon = strrchr(spec, ':'))) {
+		port = atoi(colon + 1);
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+	} else {
+		snprintf(host, sizeof(host), "%s", spec);
+	}
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	sin->sin_addr.s_addr = htonl(INADDR_ANY);
+	a->len = sizeof(*sin);
+	if (!*host)
+		return 0;
+
+	/* Look up remote hostname on DNS */
+	if (!(hp = gethostbyname(host))) {
+		fprintf(stderr, "DNS lookup failed for host %s\n", host);
+		return -1;
+	}
+	memcpy(&sin->sin_addr.s_addr, hp->h_addr, sizeof(struct in_addr));
+	return 0;
+}
+
+/* A socket connected to a, or -1 */
+int chat_connect(const struct chat_addr *a)
+{
+	int sd, one = 1;
+
+	if ((sd = socket(a->sa.ss_family, a->type, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sd, (const struct sockaddr *)&a->sa, a->len) < 0) {
+		perror("connect");
+		close(sd);
+		return -1;
+	}
+	/* Every frame goes out in a single write anyway */
+	if (a->sa.ss_family == AF_INET)
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sd;
+}
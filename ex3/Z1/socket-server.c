@@ -2,85 +2,1375 @@
  * socket-server.c
  * Simple TCP/IP communication using sockets
  *
+ * Event-driven chat server: every client is served from a single
+ * epoll loop over non-blocking sockets, and every message a client
+ * sends is broadcast to all other clients in the same room.
+ *
+ * Messages are length-prefixed frames, as chat() sends them. Each one is
+ * copied once, header and all, into a frame shared by every client it is
+ * queued for; output is written at the end of every round of events, as
+ * many queued frames per writev() as fit. The output queue of every
+ * client is bounded (-Q), so a client that does not keep up cannot hold
+ * up the others, or eat up the memory: when its queue would overflow,
+ * the oldest frames still queued are dropped, the client is disconnected,
+ * or the clients sending to it stop being read until it drains, as -o
+ * says. Only senders on the same shard can be stopped that way: frames
+ * from other shards or stdin, and those already read, are still made
+ * room for by dropping the oldest. With -m, every shard reports the depth of its queues periodically.
+ * A message of the form
+ * "/join <room>" moves its sender to another room; everybody starts in
+ * the lobby. Lines typed on the server's stdin go to all
+ * rooms, and unless -q is given, every message is printed on stdout.
+ *
+ * With -b uring, every shard is run off an io_uring instead of epoll:
+ * a multishot accept takes in the clients, a multishot receive per
+ * client reads into buffers the kernel picks from a ring of them, and
+ * the writes of a whole round go in with the one io_uring_enter() that
+ * waits for the next completions, so a round costs a single system call
+ * however many clients it serves. Frames are parsed right out of the
+ * kernel's buffer, and only an incomplete one is copied.
+ *
+ * The server listens on TCP port TCP_PORT, or -p, unless -a gives it an
+ * address of another kind: a UNIX domain stream or seqpacket socket, in
+ * the syntax of socket-common.h, for peers on the same host. On a
+ * seqpacket socket every record is made of whole frames, so at most
+ * CHAT_BUFSZ bytes of queued frames go in one write.
+ *
+ * With -t, the server runs that many shards, each a thread with an
+ * epoll loop and an SO_REUSEPORT listener of its own, so the kernel
+ * spreads new connections over them; a UNIX domain socket is only
+ * listened on once, and every shard accepts from it. Clients stay on
+ * the shard that accepted them; a message for the clients of other
+ * shards is handed to each of them through a lock-free queue, and an
+ * eventfd wakes it. Shards are pinned in turn to the CPUs the server is
+ * allowed to run on. Whether throughput scales with them is not known:
+ * it has only been run on a single CPU, where the shards take turns.
+ *
  * Vasilakis Emmanouil, Giannou Aggeliki
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "socket-common.h"
+#include "socket-uring.h"
+
+#define MAX_EVENTS	256		/* Events handled per epoll_wait() */
+#define CLIENT_BUFSZ	4096		/* Input buffer, grown for longer frames */
+#define CLIENT_QUEUE	16		/* Output queue, grown as needed */
+#define ROOM_NAMELEN	32
+#define LOBBY		"lobby"
+#define QUEUE_LIMIT	(1 << 20)	/* Bytes queued per client by default */
+
+#define URING_ENTRIES	4096		/* Submissions per round before entering */
+#define URING_NBUFS	1024		/* Receive buffers of CLIENT_BUFSZ each */
+#define URING_NRECORDS	128		/* Or of CHAT_BUFSZ, for seqpacket records */
+#define URING_BGID	0
+
+/* What an io_uring completion is for, in the low bits of its user_data */
+enum uring_op {
+	UR_RECV,
+	UR_SEND,
+	UR_ACCEPT,
+	UR_POLL,
+	UR_CANCEL,
+};
+#define UR_OPMASK	7
+
+/* What a UR_POLL is for, in place of the pointer */
+enum uring_poll {
+	POLL_XQUEUE,
+	POLL_TIMER,
+	POLL_STDIN,
+};
+
+/* What to do when the output queue of a client is full */
+enum overflow {
+	OVERFLOW_DROP,			/* Drop its oldest frames */
+	OVERFLOW_DISCONNECT,		/* Drop the client */
+	OVERFLOW_BLOCK,			/* Stop reading from the senders */
+};
+
+/*
+ * A message as it goes out, shared by the clients it is queued for and
+ * the shards it is passed to; whoever drops the last reference frees it.
+ */
+struct frame {
+	atomic_int refs;
+	int all;			/* From stdin, for every room */
+	char room[ROOM_NAMELEN];
+	size_t len;			/* Of data[], header included */
+	char data[];
+};
+
+struct xnode {
+	_Atomic(struct xnode *) next;
+	struct frame *f;
+};
+
+/*
+ * Multiple producer, single consumer queue of messages for a shard:
+ * producers only swap the head, the consumer alone walks from the tail.
+ * The eventfd is only written when the consumer may be asleep.
+ */
+struct xqueue {
+	_Atomic(struct xnode *) head;
+	struct xnode *tail;
+	struct xnode stub;
+	atomic_int signaled;
+	int efd;
+};
+
+struct shard {
+	int id;
+	pthread_t thread;
+	int epfd, sd;
+	struct uring ring;
+	struct client *clients;		/* All of its connected clients */
+	struct client *graveyard;	/* Closed, freed after the events */
+	struct client *dirty;		/* Given output in this round */
+	unsigned long nclients;
+	struct xqueue q;
+
+	/* Queue metrics, reported and reset every -m seconds */
+	int tfd;
+	unsigned long nfull;		/* Clients over the limit, if blocking */
+	unsigned long queued, deepest;	/* Frames queued, most for one client */
+	size_t queued_bytes;
+	unsigned long dropped, kicked, blocked;
+};
+
+struct client {
+	int fd;
+	struct shard *sh;
+	char room[ROOM_NAMELEN];
+
+	/* The incomplete frames read so far */
+	char *in;
+	size_t in_len, in_cap;
+
+	/* Ring of frames still to be written, the first one from out_off on */
+	struct frame **out;
+	unsigned int out_head, out_len, out_cap;
+	size_t out_off, out_bytes;
+	int want_out;			/* Registered for EPOLLOUT */
+	int full;			/* Over the limit, its senders blocked */
+	int paused;			/* Not read from, until the full drain */
+
+	/* With io_uring: the send in flight, and what is not complete yet */
+	struct iovec iov[CHAT_IOVS];
+	struct msghdr msg;
+	unsigned int sending;		/* Frames in the send in flight */
+	int recv_armed, ops;
+
+	int dead, dirty;
+	struct client *prev, *next, *dirty_next;
+};
+
+static int quiet = 0;
+static int use_uring = 0;
+static int report_secs = 0;
+static size_t queue_limit = QUEUE_LIMIT;
+static enum overflow overflow = OVERFLOW_DROP;
+static const char *overflow_names[] = { "drop", "disconnect", "block" };
+static int nshards = 1;
+static struct shard *shards;
+static int stdin_tag;				/* Event tag of stdin */
+static struct chat_addr listen_addr;
+static int seqpacket;				/* Listening on a seqpacket socket */
+
+static struct frame *frame_new(const char *room, const char *msg, size_t cnt)
+{
+	struct frame *f;
+
+	if (!(f = malloc(sizeof(*f) + FRAME_HDRLEN + cnt))) {
+		perror("malloc");
+		return NULL;
+	}
+	atomic_init(&f->refs, 1);
+	f->all = !room;
+	snprintf(f->room, sizeof(f->room), "%s", room ? room : "");
+	f->len = FRAME_HDRLEN + cnt;
+	frame_header((unsigned char *)f->data, cnt);
+	memcpy(f->data + FRAME_HDRLEN, msg, cnt);
+	return f;
+}
+
+static void frame_put(struct frame *f)
+{
+	if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1)
+		free(f);
+}
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* A submission on the ring of sh, its completion tagged with op and ptr */
+static struct io_uring_sqe *shard_sqe(struct shard *sh, enum uring_op op, void *ptr)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&sh->ring);
+
+	sqe->user_data = (unsigned long)ptr | op;
+	return sqe;
+}
+
+/* One POLLIN of fd */
+static void shard_poll(struct shard *sh, int fd, enum uring_poll which)
+{
+	struct io_uring_sqe *sqe = shard_sqe(sh, UR_POLL, (void *)((unsigned long)which << 3));
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+}
+
+static void shard_accept(struct shard *sh)
+{
+	struct io_uring_sqe *sqe = shard_sqe(sh, UR_ACCEPT, sh);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sh->sd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Receive from c for as long as it sends, into the provided buffers */
+static void client_recv(struct client *c)
+{
+	struct io_uring_sqe *sqe = shard_sqe(c->sh, UR_RECV, c);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	c->recv_armed = 1;
+	c->ops++;
+}
+
+static void client_recv_cancel(struct client *c)
+{
+	struct io_uring_sqe *sqe = shard_sqe(c->sh, UR_CANCEL, c);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long)c | UR_RECV;
+	c->ops++;
+}
+
+/* Ask epoll for what c is waiting for now; with io_uring, (un)arm its receive. */
+static int client_watch(struct client *c)
+{
+	struct epoll_event ev;
+
+	if (use_uring) {
+		if (c->paused && c->recv_armed)
+			client_recv_cancel(c);
+		else if (!c->paused && !c->recv_armed && !c->dead)
+			client_recv(c);
+		return 0;
+	}
+	ev.events = (c->paused ? 0 : EPOLLIN) | (c->want_out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	return epoll_ctl(c->sh->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* A full client has drained: once none is left, read from everybody again. */
+static void client_unfull(struct client *c)
+{
+	struct shard *sh = c->sh;
+	struct client *p;
+
+	c->full = 0;
+	if (--sh->nfull)
+		return;
+	for (p = sh->clients; p; p = p->next)
+		if (p->paused) {
+			p->paused = 0;
+			if (client_watch(p) < 0)
+				perror("epoll_ctl");
+		}
+}
+
+/*
+ * A broadcast may find any client gone, including ones with events still
+ * pending in this round, so clients are only freed once it is over.
+ */
+static void client_close(struct client *c)
+{
+	struct shard *sh = c->sh;
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		sh->clients = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	sh->nclients--;
+	sh->queued -= c->out_len;
+	sh->queued_bytes -= c->out_bytes;
+	if (c->full)
+		client_unfull(c);
+
+	/*
+	 * With io_uring, shutdown() ends what is going on on the socket, but
+	 * a send may still be queued and not yet submitted: the descriptor is
+	 * only closed once it is done, or the next client accepted could get
+	 * its number, and the rest of our frames. With epoll, closing the
+	 * socket also takes it out of the epoll set.
+	 */
+	if (use_uring)
+		shutdown(c->fd, SHUT_RDWR);
+	else if (close(c->fd) < 0)
+		perror("close");
+	c->dead = 1;
+	c->next = sh->graveyard;
+	sh->graveyard = c;
+}
+
+static void bury_clients(struct shard *sh)
+{
+	struct client *c, **p = &sh->graveyard;
+
+	while ((c = *p)) {
+		/* Not before io_uring is done with it */
+		if (c->ops) {
+			p = &c->next;
+			continue;
+		}
+		*p = c->next;
+		if (use_uring && close(c->fd) < 0)
+			perror("close");
+		for (; c->out_len; c->out_len--, c->out_head++)
+			frame_put(c->out[c->out_head & (c->out_cap - 1)]);
+		free(c->out);
+		free(c->in);
+		free(c);
+	}
+}
+
+/* Take the oldest frame off the queue of c. */
+static struct frame *client_pop(struct client *c)
+{
+	struct frame *f = c->out[c->out_head++ & (c->out_cap - 1)];
+
+	c->out_len--;
+	c->out_bytes -= f->len;
+	c->sh->queued--;
+	c->sh->queued_bytes -= f->len;
+	return f;
+}
+
+/*
+ * Point iov at the queued frames, as many as fit, or as fit in one
+ * record on a seqpacket socket; returns how many.
+ */
+static int client_iov(struct client *c, struct iovec *iov)
+{
+	struct frame *f;
+	unsigned int i;
+	size_t len = 0;
+
+	for (i = 0; i < c->out_len && i < CHAT_IOVS; i++) {
+		f = c->out[(c->out_head + i) & (c->out_cap - 1)];
+		if (seqpacket && (len += f->len) > CHAT_BUFSZ && i)
+			break;
+		iov[i].iov_base = f->data + (i ? 0 : c->out_off);
+		iov[i].iov_len = f->len - (i ? 0 : c->out_off);
+	}
+	return i;
+}
+
+/* n bytes of the queue of c have gone out */
+static void client_sent(struct client *c, size_t n)
+{
+	struct frame *f;
+
+	/* Drop the frames that went out whole */
+	while (n > 0) {
+		f = c->out[c->out_head & (c->out_cap - 1)];
+		if (n < f->len - c->out_off) {
+			c->out_off += n;
+			break;
+		}
+		n -= f->len - c->out_off;
+		c->out_off = 0;
+		frame_put(client_pop(c));
+	}
+	/* Drained to half the limit: let its senders go on */
+	if (c->full && c->out_bytes <= queue_limit / 2)
+		client_unfull(c);
+}
+
+/*
+ * Write as many queued frames as the socket takes, return -1 if it is
+ * gone. With io_uring, send them, once the send before is complete.
+ */
+static int client_flush(struct client *c)
+{
+	struct iovec iov[CHAT_IOVS];
+	struct io_uring_sqe *sqe;
+	ssize_t n;
+	int cnt;
+
+	if (use_uring) {
+		if (c->sending || !c->out_len)
+			return 0;
+		c->msg.msg_iov = c->iov;
+		c->msg.msg_iovlen = c->sending = client_iov(c, c->iov);
+		sqe = shard_sqe(c->sh, UR_SEND, c);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = c->fd;
+		sqe->addr = (unsigned long)&c->msg;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		c->ops++;
+		return 0;
+	}
+
+	while (c->out_len) {
+		cnt = client_iov(c, iov);
+		if ((n = writev(c->fd, iov, cnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		client_sent(c, n);
+	}
+
+	/* Only ask for EPOLLOUT while there is something left to write */
+	if (!c->out_len != !c->want_out) {
+		c->want_out = !!c->out_len;
+		if (client_watch(c) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Drop the oldest frame queued for c but the first keep ones, which are
+ * being written.
+ */
+static void client_drop(struct client *c, unsigned int keep)
+{
+	unsigned int i, mask = c->out_cap - 1;
+	struct frame *f = c->out[(c->out_head + keep) & mask];
+
+	for (i = keep; i > 0; i--)
+		c->out[(c->out_head + i) & mask] = c->out[(c->out_head + i - 1) & mask];
+	c->out[c->out_head & mask] = f;
+	frame_put(client_pop(c));
+	c->sh->dropped++;
+}
+
+/*
+ * Make room for f in the queue of c, as the overflow policy says; return
+ * -1 if c is to be disconnected. Whatever is being written stays.
+ */
+static int client_overflow(struct client *c, struct client *from, struct frame *f)
+{
+	struct shard *sh = c->sh;
+	unsigned int keep = c->sending ? c->sending : !!c->out_off;
+
+	switch (overflow) {
+	case OVERFLOW_DROP:
+		while (c->out_len > keep && c->out_bytes + f->len > queue_limit)
+			client_drop(c, keep);
+		return 0;
+	case OVERFLOW_DISCONNECT:
+		sh->kicked++;
+		return -1;
+	case OVERFLOW_BLOCK:
+		/*
+		 * A sender on this shard is not read any further. What was
+		 * read already, and what other shards and stdin send, cannot
+		 * be held back: room is made for it by dropping, as with
+		 * OVERFLOW_DROP, so the queue stays bounded all the same.
+		 */
+		if (!c->full) {
+			c->full = 1;
+			sh->nfull++;
+		}
+		if (from && !from->paused) {
+			from->paused = 1;
+			sh->blocked++;
+			if (client_watch(from) < 0)
+				perror("epoll_ctl");
+		}
+		while (c->out_len > keep && c->out_bytes + f->len > queue_limit)
+			client_drop(c, keep);
+		return 0;
+	}
+	return 0;
+}
+
+/* Queue f for c, to be written at the end of the round. */
+static int client_send(struct client *c, struct client *from, struct frame *f)
+{
+	struct frame **out;
+	unsigned int i, cap;
+
+	if (c->out_bytes + f->len > queue_limit && client_overflow(c, from, f) < 0)
+		return -1;
+	if (c->out_len == c->out_cap) {
+		cap = c->out_cap ? 2 * c->out_cap : CLIENT_QUEUE;
+		if (!(out = malloc(cap * sizeof(*out))))
+			return -1;
+		for (i = 0; i < c->out_len; i++)
+			out[i] = c->out[(c->out_head + i) & (c->out_cap - 1)];
+		free(c->out);
+		c->out = out;
+		c->out_cap = cap;
+		c->out_head = 0;
+	}
+	atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+	c->out[(c->out_head + c->out_len++) & (c->out_cap - 1)] = f;
+	c->out_bytes += f->len;
+	c->sh->queued++;
+	c->sh->queued_bytes += f->len;
+	if (c->out_len > c->sh->deepest)
+		c->sh->deepest = c->out_len;
+
+	/* Already waiting for EPOLLOUT, it will be flushed then */
+	if (!c->dirty && !c->want_out) {
+		c->dirty = 1;
+		c->dirty_next = c->sh->dirty;
+		c->sh->dirty = c;
+	}
+	return 0;
+}
+
+/* Write out what the round of events has queued. */
+static void shard_flush(struct shard *sh)
+{
+	struct client *c;
+
+	while ((c = sh->dirty)) {
+		sh->dirty = c->dirty_next;
+		c->dirty = 0;
+		if (!c->dead && client_flush(c) < 0) {
+			if (!quiet)
+				fprintf(stderr, "Client %d went away\n", c->fd);
+			client_close(c);
+		}
+	}
+}
+
+/* Send f to everybody on sh in its room, but from. */
+static void local_broadcast(struct shard *sh, struct client *from, struct frame *f)
+{
+	struct client *c, *next;
+
+	for (c = sh->clients; c; c = next) {
+		next = c->next;
+		if (c == from || (!f->all && strcmp(c->room, f->room)))
+			continue;
+		if (client_send(c, from, f) < 0) {
+			if (!quiet)
+				fprintf(stderr, "Client %d cannot keep up, dropped\n", c->fd);
+			client_close(c);
+		}
+	}
+}
+
+static void xqueue_init(struct xqueue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+	atomic_init(&q->signaled, 0);
+	if ((q->efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+}
 
-int main(void)
+static void xqueue_push(struct xqueue *q, struct xnode *n)
+{
+	struct xnode *prev;
+
+	atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/* The oldest node, or NULL if none is there yet; consumer only. */
+static struct xnode *xqueue_pop(struct xqueue *q)
+{
+	struct xnode *tail = q->tail, *next;
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	/* tail is the last node: put the stub behind it to take it out */
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;	/* A push is halfway through, it will be back */
+	xqueue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* Everybody in the room of f, on every shard, gets it. */
+static void broadcast(struct shard *sh, struct client *from, struct frame *f)
+{
+	struct xnode *n;
+	uint64_t one = 1;
+	int i;
+
+	local_broadcast(sh, from, f);
+	if (nshards == 1)
+		return;
+
+	atomic_fetch_add_explicit(&f->refs, nshards - 1, memory_order_relaxed);
+	for (i = 0; i < nshards; i++) {
+		if (&shards[i] == sh)
+			continue;
+		if (!(n = malloc(sizeof(*n)))) {
+			perror("malloc");
+			exit(1);
+		}
+		n->f = f;
+		xqueue_push(&shards[i].q, n);
+		if (!atomic_exchange(&shards[i].q.signaled, 1) &&
+		    write(shards[i].q.efd, &one, sizeof(one)) < 0)
+			perror("write to eventfd");
+	}
+}
+
+/* Pass on what the other shards have sent to our clients. */
+static void shard_receive(struct shard *sh)
+{
+	struct xnode *n;
+	uint64_t cnt;
+
+	if (read(sh->q.efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		perror("read from eventfd");
+	atomic_store(&sh->q.signaled, 0);
+
+	while ((n = xqueue_pop(&sh->q))) {
+		local_broadcast(sh, NULL, n->f);
+		frame_put(n->f);
+		if (n != &sh->q.stub)
+			free(n);
+	}
+}
+
+/* A complete message from c, the payload of a frame. */
+static void client_message(struct client *c, const char *msg, size_t cnt)
+{
+	struct frame *f;
+	size_t len;
+
+	if (cnt >= 6 && !memcmp(msg, "/join ", 6)) {
+		for (msg += 6, cnt -= 6; cnt && (*msg == ' ' || *msg == '\t'); msg++, cnt--)
+			;
+		for (len = 0; len < cnt && len < ROOM_NAMELEN - 1; len++)
+			if (msg[len] == '\r' || msg[len] == '\n' || !msg[len])
+				break;
+		while (len > 0 && isspace((unsigned char)msg[len - 1]))
+			len--;
+		/* Without a name, the client stays where it is */
+		if (!len)
+			return;
+		memcpy(c->room, msg, len);
+		c->room[len] = '\0';
+		return;
+	}
+
+	if (!quiet) {
+		printf("[%s] ", c->room);
+		fwrite(msg, 1, cnt, stdout);
+	}
+	if ((f = frame_new(c->room, msg, cnt))) {
+		broadcast(c->sh, c, f);
+		frame_put(f);
+	}
+}
+
+/* Make room for size bytes of input */
+static int client_reserve(struct client *c, size_t size)
+{
+	char *in;
+
+	if (size <= c->in_cap)
+		return 0;
+	if (size < 2 * c->in_cap)
+		size = 2 * c->in_cap;
+	if (!(in = realloc(c->in, size)))
+		return -1;
+	c->in = in;
+	c->in_cap = size;
+	return 0;
+}
+
+/* Relay every complete frame in buf; return the bytes they take up, or -1 */
+static ssize_t client_frames(struct client *c, char *buf, size_t len)
+{
+	struct iovec iov[CHAT_IOVS];
+	ssize_t used;
+	size_t pos = 0;
+	int i, cnt;
+
+	do {
+		cnt = CHAT_IOVS;
+		if ((used = frame_parse(buf + pos, len - pos, iov, &cnt)) < 0)
+			return -1;
+		for (i = 0; i < cnt; i++)
+			client_message(c, iov[i].iov_base, iov[i].iov_len);
+		pos += used;
+	} while (cnt == CHAT_IOVS);
+
+	return pos;
+}
+
+/* Read what c has sent, return -1 once it is gone or breaks the framing. */
+static int client_read(struct client *c)
+{
+	ssize_t n, used;
+
+	/* Blocked by a full client, the rest is left in the socket */
+	while (!c->paused) {
+		/* Room for a whole record, or the rest of it is lost */
+		if (seqpacket && client_reserve(c, c->in_len + CHAT_BUFSZ) < 0)
+			return -1;
+		n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		c->in_len += n;
+
+		/* Relay every complete frame right from in[], keep the rest */
+		if ((used = client_frames(c, c->in, c->in_len)) < 0)
+			return -1;
+		c->in_len -= used;
+		memmove(c->in, c->in + used, c->in_len);
+		if (seqpacket && c->in_len)
+			return -1;
+
+		/* Make room for the whole of a long frame */
+		if (c->in_len >= FRAME_HDRLEN &&
+		    client_reserve(c, FRAME_HDRLEN + frame_length(c->in)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * What io_uring has received for c, in one of the provided buffers:
+ * frames are relayed right from it, unless part of one came before.
+ */
+static int client_input(struct client *c, char *buf, size_t len)
+{
+	ssize_t used;
+
+	if (!c->in_len) {
+		if ((used = client_frames(c, buf, len)) < 0)
+			return -1;
+		buf += used;
+		len -= used;
+	}
+	/* A seqpacket record is whole frames, or too long for the buffer */
+	if (seqpacket && len)
+		return -1;
+	if (!len)
+		return 0;
+	if (client_reserve(c, c->in_len + len) < 0)
+		return -1;
+	memcpy(c->in + c->in_len, buf, len);
+	c->in_len += len;
+	if (c->in_len == len)
+		return 0;
+
+	if ((used = client_frames(c, c->in, c->in_len)) < 0)
+		return -1;
+	c->in_len -= used;
+	memmove(c->in, c->in + used, c->in_len);
+	return 0;
+}
+
+/* Take in the new connection newsd on sh. */
+static void client_new(struct shard *sh, int newsd)
 {
 	char addrstr[INET_ADDRSTRLEN];
-	int sd, newsd;
-	socklen_t len;
+	struct epoll_event ev;
 	struct sockaddr_in sa;
+	struct client *c = NULL;
+	socklen_t len = sizeof(sa);
+	int one = 1;
 
-	/* Make sure a broken connection doesn't kill us */
-	signal(SIGPIPE, SIG_IGN);
+	if (set_nonblock(newsd) < 0 || !(c = calloc(1, sizeof(*c))) ||
+	    !(c->in = malloc(CLIENT_BUFSZ))) {
+		perror("new client");
+		if (c)
+			free(c);
+		close(newsd);
+		return;
+	}
+	/* Writes are batched per round already, Nagle would only delay them */
+	if (listen_addr.sa.ss_family == AF_INET)
+		setsockopt(newsd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->in_cap = CLIENT_BUFSZ;
+	c->fd = newsd;
+	c->sh = sh;
+	strcpy(c->room, LOBBY);
+
+	if (use_uring) {
+		client_recv(c);
+	} else {
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, newsd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(newsd);
+			free(c->in);
+			free(c);
+			return;
+		}
+	}
+	c->next = sh->clients;
+	if (sh->clients)
+		sh->clients->prev = c;
+	sh->clients = c;
+	sh->nclients++;
+
+	if (quiet)
+		return;
+	if (listen_addr.sa.ss_family == AF_UNIX)
+		fprintf(stderr, "Incoming local connection, %lu clients on shard %d\n",
+			sh->nclients, sh->id);
+	else if (!getpeername(newsd, (struct sockaddr *)&sa, &len) &&
+		 inet_ntop(AF_INET, &sa.sin_addr, addrstr, sizeof(addrstr)))
+		fprintf(stderr, "Incoming connection from %s:%d, %lu clients on shard %d\n",
+			addrstr, ntohs(sa.sin_port), sh->nclients, sh->id);
+}
+
+static void server_accept(struct shard *sh)
+{
+	int newsd;
+
+	for (;;) {
+		if ((newsd = accept(sh->sd, NULL, NULL)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("accept");
+			return;
+		}
+		client_new(sh, newsd);
+	}
+}
+
+/* Lines typed on stdin go to everybody; returns 0 at its end. */
+static int server_stdin(struct shard *sh)
+{
+	char buf[FRAME_MAXLEN];
+	struct frame *f;
+	ssize_t n;
+
+	n = read(0, buf, sizeof(buf));
+	if (n < 0) {
+		perror("read from stdin failed");
+		exit(1);
+	}
+	if (n == 0)
+		return 0;
+	if ((f = frame_new(NULL, buf, n))) {
+		broadcast(sh, NULL, f);
+		frame_put(f);
+	}
+	return 1;
+}
+
+/* How deep the queues have been since the last time. */
+static void shard_report(struct shard *sh)
+{
+	struct client *c;
+	uint64_t n;
+
+	if (read(sh->tfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		perror("read from timerfd");
+	fprintf(stderr, "shard %d: %lu clients, %lu frames (%zu KiB) queued, deepest %lu, "
+		"%lu dropped, %lu disconnected, %lu blocked\n", sh->id, sh->nclients,
+		sh->queued, sh->queued_bytes >> 10, sh->deepest, sh->dropped, sh->kicked,
+		sh->blocked);
+
+	sh->deepest = sh->dropped = sh->kicked = sh->blocked = 0;
+	for (c = sh->clients; c; c = c->next)
+		if (c->out_len > sh->deepest)
+			sh->deepest = c->out_len;
+}
+
+/* A listening socket of our own, sharing a TCP port with the other shards. */
+static int server_listen(const struct chat_addr *a)
+{
+	const char *path = ((struct sockaddr_un *)&a->sa)->sun_path;
+	struct stat st;
+	int sd, one = 1;
 
-	/* Create TCP/IP socket, used as main chat channel */
-	if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+	/* Create the socket, used as main chat channel */
+	if ((sd = socket(a->sa.ss_family, a->type, 0)) < 0) {
 		perror("socket");
 		exit(1);
 	}
-	fprintf(stderr, "Created TCP socket\n");
+	if (a->sa.ss_family == AF_UNIX) {
+		/*
+		 * The socket left by a server before us; anything else at the
+		 * path stays, and bind() fails with EADDRINUSE
+		 */
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) < 0)
+			perror("unlink");
+	} else {
+		if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+			perror("setsockopt(SO_REUSEADDR)");
+		if (nshards > 1 &&
+		    setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			exit(1);
+		}
+	}
 
-	/* Bind to a well-known port */
-	memset(&sa, 0, sizeof(sa));
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(TCP_PORT);
-	sa.sin_addr.s_addr = htonl(INADDR_ANY);
-	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+	/* Bind to a well-known port, or path */
+	if (bind(sd, (const struct sockaddr *)&a->sa, a->len) < 0) {
 		perror("bind");
 		exit(1);
 	}
-	fprintf(stderr, "Bound TCP socket to port %d\n", TCP_PORT);
 
 	/* Listen for incoming connections */
-	if (listen(sd, TCP_BACKLOG) < 0) {
+	if (listen(sd, TCP_BACKLOG) < 0 || set_nonblock(sd) < 0) {
 		perror("listen");
 		exit(1);
 	}
+	return sd;
+}
 
-	/* Loop forever, accept()ing connections */
-	for (;;) {
-		fprintf(stderr, "Waiting for an incoming connection...\n");
+static void shard_init(struct shard *sh, int id)
+{
+	struct itimerspec its = { { report_secs, 0 }, { report_secs, 0 } };
+	struct epoll_event ev;
+	int shared = id && listen_addr.sa.ss_family == AF_UNIX;
+
+	sh->id = id;
+	sh->sd = shared ? shards[0].sd : server_listen(&listen_addr);
+	xqueue_init(&sh->q);
+	sh->tfd = -1;
+	if (report_secs && ((sh->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+	    timerfd_settime(sh->tfd, 0, &its, NULL) < 0)) {
+		perror("timerfd");
+		exit(1);
+	}
+	/* The ring is set up by the thread that is to use it */
+	if (use_uring)
+		return;
+
+	if ((sh->epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	/* Only one of the shards sharing a listener is woken for a client */
+	ev.events = EPOLLIN | (nshards > 1 && listen_addr.sa.ss_family == AF_UNIX ?
+		EPOLLEXCLUSIVE : 0);
+	ev.data.ptr = &sh->sd;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->sd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sh->q;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->q.efd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	ev.data.ptr = &sh->tfd;
+	if (report_secs && epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->tfd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
 
-		/* Accept an incoming connection */
-		len = sizeof(struct sockaddr_in);
-		if ((newsd = accept(sd, (struct sockaddr *)&sa, &len)) < 0) {
-			perror("accept");
+/* Loop forever, serving whoever of the shard's clients is ready */
+static void *shard_loop(void *arg)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct shard *sh = arg;
+	struct client *c;
+	int i, n;
+
+	for (;;) {
+		if ((n = epoll_wait(sh->epfd, events, MAX_EVENTS, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
 			exit(1);
 		}
-		if (!inet_ntop(AF_INET, &sa.sin_addr, addrstr, sizeof(addrstr))) {
-			perror("could not format IP address");
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &sh->sd) {
+				server_accept(sh);
+				continue;
+			}
+			if (events[i].data.ptr == &sh->q) {
+				shard_receive(sh);
+				continue;
+			}
+			if (events[i].data.ptr == &stdin_tag) {
+				/* At its end, keep serving, but stop watching stdin */
+				if (!server_stdin(sh))
+					epoll_ctl(sh->epfd, EPOLL_CTL_DEL, 0, NULL);
+				continue;
+			}
+			if (events[i].data.ptr == &sh->tfd) {
+				shard_report(sh);
+				continue;
+			}
+
+			c = events[i].data.ptr;
+			if (c->dead)
+				continue;
+			if (events[i].events & EPOLLOUT && client_flush(c) < 0) {
+				client_close(c);
+				continue;
+			}
+			/* A blocked client is not read, but still hangs up */
+			if (events[i].events & (EPOLLHUP | EPOLLERR) && c->paused) {
+				client_close(c);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && client_read(c) < 0) {
+				if (!quiet)
+					fprintf(stderr, "Peer went away, %lu clients on shard %d\n",
+						sh->nclients - 1, sh->id);
+				client_close(c);
+			}
+		}
+		shard_flush(sh);
+		bury_clients(sh);
+		if (!quiet)
+			fflush(stdout);
+	}
+
+	/* This will never happen */
+	return NULL;
+}
+
+/* A completion of the multishot receive of c */
+static void client_received(struct client *c, int res, unsigned int flags)
+{
+	struct shard *sh = c->sh;
+	unsigned short bid;
+	int gone = 0;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		c->recv_armed = 0;
+		c->ops--;
+	}
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!c->dead && res > 0)
+			gone = client_input(c, uring_buf(&sh->ring, bid), res) < 0;
+		uring_provide(&sh->ring, bid);
+	}
+	if (c->dead)
+		return;
+
+	/* Out of buffers, or cancelled to block it: neither is the end */
+	if (gone || res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+		if (!quiet)
+			fprintf(stderr, "Peer went away, %lu clients on shard %d\n",
+				sh->nclients - 1, sh->id);
+		client_close(c);
+		return;
+	}
+	if (!c->recv_armed && !c->paused)
+		client_recv(c);
+}
+
+/* A completion of the send of c */
+static void client_sent_uring(struct client *c, int res)
+{
+	c->ops--;
+	c->sending = 0;
+	if (c->dead)
+		return;
+	if (res < 0) {
+		if (!quiet)
+			fprintf(stderr, "Client %d went away\n", c->fd);
+		client_close(c);
+		return;
+	}
+	client_sent(c, res);
+	client_flush(c);
+}
+
+static void shard_uring_init(struct shard *sh)
+{
+	if (uring_init(&sh->ring, URING_ENTRIES) < 0 ||
+	    (seqpacket ? uring_provide_init(&sh->ring, URING_BGID, URING_NRECORDS, CHAT_BUFSZ) :
+	     uring_provide_init(&sh->ring, URING_BGID, URING_NBUFS, CLIENT_BUFSZ)) < 0) {
+		perror("io_uring");
+		exit(1);
+	}
+	shard_accept(sh);
+	shard_poll(sh, sh->q.efd, POLL_XQUEUE);
+	if (sh->tfd >= 0)
+		shard_poll(sh, sh->tfd, POLL_TIMER);
+	if (sh->id == 0)
+		shard_poll(sh, 0, POLL_STDIN);
+}
+
+/*
+ * The same loop off an io_uring: every round submits what the last one
+ * has queued and waits for completions in one system call.
+ */
+static void *shard_uring_loop(void *arg)
+{
+	struct shard *sh = arg;
+	struct io_uring_cqe *cqe;
+	unsigned long data;
+	unsigned int flags;
+	void *ptr;
+	int res;
+
+	shard_uring_init(sh);
+	for (;;) {
+		if (uring_submit(&sh->ring, 1) < 0) {
+			perror("io_uring_enter");
 			exit(1);
 		}
-		fprintf(stderr, "Incoming connection from %s:%d\n",
-			addrstr, ntohs(sa.sin_port));
+		while ((cqe = uring_cqe(&sh->ring))) {
+			data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(&sh->ring);
+			ptr = (void *)(data & ~(unsigned long)UR_OPMASK);
+
+			switch (data & UR_OPMASK) {
+			case UR_ACCEPT:
+				if (res >= 0)
+					client_new(sh, res);
+				else if (res != -EINTR && res != -EAGAIN)
+					fprintf(stderr, "accept: %s\n", strerror(-res));
+				if (!(flags & IORING_CQE_F_MORE))
+					shard_accept(sh);
+				break;
+			case UR_RECV:
+				client_received(ptr, res, flags);
+				break;
+			case UR_SEND:
+				client_sent_uring(ptr, res);
+				break;
+			case UR_CANCEL:
+				((struct client *)ptr)->ops--;
+				break;
+			case UR_POLL:
+				switch (data >> 3) {
+				case POLL_XQUEUE:
+					shard_receive(sh);
+					shard_poll(sh, sh->q.efd, POLL_XQUEUE);
+					break;
+				case POLL_TIMER:
+					shard_report(sh);
+					shard_poll(sh, sh->tfd, POLL_TIMER);
+					break;
+				case POLL_STDIN:
+					if (server_stdin(sh))
+						shard_poll(sh, 0, POLL_STDIN);
+					break;
+				}
+				break;
+			}
+		}
+		shard_flush(sh);
+		bury_clients(sh);
+		if (!quiet)
+			fflush(stdout);
+	}
 
-		/* We break out of the loop when the remote peer goes away */
-		chat(newsd);
+	/* This will never happen */
+	return NULL;
+}
 
-		/* Make sure we don't leak open files */
-		if (close(newsd) < 0)
-			perror("close");
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-q] [-p port | -a address] [-b backend] [-t shards] [-Q bytes]\n"
+		"          [-o policy] [-m secs]\n"
+		"  -a is [host][:port], unix:PATH or unix-seqpacket:PATH\n"
+		"  -b is epoll, the default, or uring\n"
+		"  -t 0 runs a shard on every CPU the server may run on; how throughput\n"
+		"     scales with the shards has not been measured, on one CPU only\n"
+		"  -Q bounds the output queue of every client, %d bytes by default\n"
+		"  -o is what to do when it overflows: drop (the oldest frames), disconnect\n"
+		"     (the client) or block (its senders on the same shard until it drains,\n"
+		"     dropping the oldest frames for anything else)\n"
+		"  -m reports the queues of every shard every secs seconds\n",
+		argv0, QUEUE_LIMIT);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	void *(*loop)(void *) = shard_loop;
+	struct epoll_event ev;
+	cpu_set_t allowed, cpus;
+	const char *address = "";
+	int i, n, opt, ncpus, port = TCP_PORT;
+	int *cpu;
+
+	while ((opt = getopt(argc, argv, "qp:a:b:t:Q:o:m:")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'a':
+			address = optarg;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "uring"))
+				use_uring = 1;
+			else if (strcmp(optarg, "epoll"))
+				usage(argv[0]);
+			break;
+		case 't':
+			nshards = atoi(optarg);
+			break;
+		case 'Q':
+			queue_limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			for (i = 0; i < 3 && strcmp(optarg, overflow_names[i]); i++)
+				;
+			if (i == 3)
+				usage(argv[0]);
+			overflow = i;
+			break;
+		case 'm':
+			report_secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* The CPUs we may run on, which the cpuset may well restrict */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	ncpus = CPU_COUNT(&allowed);
+	if (!(cpu = malloc(ncpus * sizeof(*cpu)))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0, n = 0; n < ncpus; i++)
+		if (CPU_ISSET(i, &allowed))
+			cpu[n++] = i;
+	if (nshards == 0)
+		nshards = ncpus;
+	/* A frame of any length must fit in an empty queue */
+	if (nshards < 1 || queue_limit < CHAT_BUFSZ || report_secs < 0)
+		usage(argv[0]);
+	if (chat_address(address, port, &listen_addr) < 0)
+		exit(1);
+	seqpacket = listen_addr.type == SOCK_SEQPACKET;
+
+	/* Make sure a broken connection doesn't kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!(shards = calloc(nshards, sizeof(*shards)))) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nshards; i++)
+		shard_init(&shards[i], i);
+	if (listen_addr.sa.ss_family == AF_UNIX)
+		fprintf(stderr, "Listening on %s", address);
+	else
+		fprintf(stderr, "Listening on TCP port %d",
+			ntohs(((struct sockaddr_in *)&listen_addr.sa)->sin_port));
+	fprintf(stderr, " with %d %s shard%s, queues of %zu bytes, %s on overflow\n",
+		nshards, use_uring ? "io_uring" : "epoll", nshards > 1 ? "s" : "",
+		queue_limit, overflow_names[overflow]);
+
+	/* stdin may well be /dev/null or a file, which epoll refuses */
+	if (use_uring) {
+		loop = shard_uring_loop;
+	} else {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &stdin_tag;
+		if (epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, 0, &ev) < 0 && errno != EPERM)
+			perror("epoll_ctl(stdin)");
+	}
+
+	/* One shard per CPU, the first one on this thread */
+	if (nshards > ncpus)
+		fprintf(stderr, "%d shards on %d CPU%s, some of them share one\n",
+			nshards, ncpus, ncpus > 1 ? "s" : "");
+	for (i = 0; i < nshards; i++) {
+		if (nshards > 1) {
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu[i % ncpus], &cpus);
+		}
+		if (i == 0) {
+			shards[i].thread = pthread_self();
+		} else if ((errno = pthread_create(&shards[i].thread, NULL, loop, &shards[i]))) {
+			perror("pthread_create");
+			exit(1);
+		}
+		if (nshards > 1 &&
+		    (errno = pthread_setaffinity_np(shards[i].thread, sizeof(cpus), &cpus)))
+			fprintf(stderr, "Shard %d stays unpinned, CPU %d: %s\n",
+				i, cpu[i % ncpus], strerror(errno));
 	}
+	free(cpu);
+	loop(&shards[0]);
 
 	/* This will never happen */
 	return 1;
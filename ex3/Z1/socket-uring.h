@@ -0,0 +1,182 @@
+/*
+ * socket-uring.h
+ *
+ * Just enough io_uring for the chat server, straight on the system
+ * calls: a submission and a completion ring, and a ring of buffers the
+ * kernel picks from for multishot receives.
+ *
+ * Vasilakis Emmanouil, Giannou Aggeliki
+ */
+
+#ifndef _SOCKET_URING_H
+#define _SOCKET_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+
+	/* Submission ring: tail is ours, head the kernel's */
+	unsigned int *sq_head, *sq_tail;
+	unsigned int sq_mask, sq_entries, sq_local;	/* Tail, not yet published */
+	struct io_uring_sqe *sqes;
+
+	/* Completion ring: the other way round */
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffers, nbufs of bufsz bytes each */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned int nbufs, bufsz;
+	unsigned short br_tail;
+};
+
+/* A ring of at least entries submissions, and four times as many completions */
+int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *array, i;
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = 4 * entries;
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0 && errno == EINVAL) {
+		/* Older kernels know none of the hints */
+		p.flags = IORING_SETUP_CQSIZE;
+		r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (r->fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+	sq = cq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		return -1;
+
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	/* Every slot of the ring always holds the submission of the same index */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/*
+ * Hand the kernel what has been queued and, if wait, block until there
+ * is at least one completion. Returns -1 on error; being interrupted, or
+ * told to reap completions first, is not one.
+ */
+int uring_submit(struct uring *r, int wait)
+{
+	unsigned int n;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	n = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	ret = syscall(__NR_io_uring_enter, r->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+		NULL, 0);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+		return 0;
+	return ret < 0 ? -1 : 0;
+}
+
+/* An empty submission at the tail, submitting what is queued if the ring is full */
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+		if (uring_submit(r, 0) < 0) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+	sqe = &r->sqes[r->sq_local++ & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* The oldest completion not yet seen, or NULL */
+struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Give buffer bid back to the kernel */
+void uring_provide(struct uring *r, unsigned short bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+
+	buf->addr = (unsigned long)(r->bufs + (size_t)bid * r->bufsz);
+	buf->len = r->bufsz;
+	buf->bid = bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Register nbufs buffers of bufsz bytes as buffer group bgid; nbufs a power of 2 */
+int uring_provide_init(struct uring *r, unsigned short bgid, unsigned int nbufs,
+	unsigned int bufsz)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	r->nbufs = nbufs;
+	r->bufsz = bufsz;
+	r->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED || !(r->bufs = malloc((size_t)nbufs * bufsz)))
+		return -1;
+	r->br_tail = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)r->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+	for (i = 0; i < nbufs; i++)
+		uring_provide(r, i);
+	return 0;
+}
+
+char *uring_buf(struct uring *r, unsigned short bid)
+{
+	return r->bufs + (size_t)bid * r->bufsz;
+}
+
+#endif /* _SOCKET_URING_H */